@@ -0,0 +1,393 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include <9pclient.h>
+#include "../hist.h"
+
+/*
+ * Load generator for a running hubfs. Writers and readers are threads
+ * in one proc sharing one 9p connection, so the client costs little next
+ * to the server. Every message begins with the time it was written, its
+ * length and two magic bytes. Readers find the messages in what they read,
+ * carrying one split between reads over to the next, so delivery latency
+ * is measured per message whether or not the hubs are in record mode (-R).
+ * Results are printed as "key value" lines like the hubfs stats files.
+*/
+
+enum{
+	STACK = 16*1024,
+	HDR = 12,				/* Write time, length and magic at the start of every message */
+	MAGIC0 = 'h',
+	MAGIC1 = 'b',
+	MAXMSG = 8000,			/* Larger writes would be split by the default msize */
+	RBUF = 8192,
+	EOFMS = 100,			/* Milliseconds between eofs sent to drain readers */
+};
+
+enum{
+	Dfixed,					/* every message is msgsize bytes */
+	Duniform,				/* sizes spread evenly up to twice msgsize */
+	Dexp,					/* exponentially distributed with mean msgsize */
+};
+
+char *dists[] = {
+	[Dfixed] = "fixed",
+	[Duniform] = "uniform",
+	[Dexp] = "exp",
+};
+
+CFsys *fs;
+char *srvname = "hubfs";
+char *prefix = "bench";
+int nhubs = 1;
+int nwriters = 1;				/* Writers for each hub */
+int nreaders = 1;				/* Readers for each hub */
+int msgsize = 512;
+int dist = Dfixed;
+int seconds = 5;
+vlong permsgs;					/* Messages each writer sends, 0 to run for seconds */
+char *ctls[16];					/* Extra commands written to ctl before starting */
+int nctls;
+int keep;						/* Leave the hubs behind when done */
+int record;						/* Put the hubs in record mode */
+vlong tstart;					/* No message is older than this */
+
+int stop;						/* Set when writers should finish */
+int drained;					/* Set when all readers have finished */
+Channel *donec;
+
+/* all clients run in one proc, so these need no locking */
+vlong writes;
+vlong bytesin;
+vlong werrors;
+vlong reads;
+vlong msgsout;
+vlong bytesout;
+vlong gaps;
+vlong rerrors;
+Hist *wlat;						/* Twrite to Rwrite */
+Hist *dlat;						/* Twrite to the Rread delivering the message */
+
+void
+usage(void)
+{
+	fprint(2,
+		"usage: %s [-kR] [-s srvname] [-p prefix] [-h nhubs] [-w writers] [-r readers]"
+		" [-m msgsize] [-d fixed|uniform|exp] [-t seconds] [-n msgs] [-c ctlcmd]...\n"
+		, argv0);
+	threadexitsall("usage");
+}
+
+int
+msglen(void)
+{
+	double n;
+
+	switch(dist){
+	case Duniform:
+		n = 1 + nrand(2*msgsize);
+		break;
+	case Dexp:
+		n = -log(1.0 - frand()) * msgsize;
+		break;
+	default:
+		n = msgsize;
+		break;
+	}
+	if(n < HDR)
+		n = HDR;
+	if(n > MAXMSG)
+		n = MAXMSG;
+	return n;
+}
+
+void
+put8(uchar *p, uvlong v)
+{
+	int i;
+
+	for(i = 0; i < 8; i++)
+		p[i] = v >> 8*i;
+}
+
+uvlong
+get8(uchar *p)
+{
+	uvlong v;
+	int i;
+
+	v = 0;
+	for(i = 7; i >= 0; i--)
+		v = v<<8 | p[i];
+	return v;
+}
+
+void
+writer(void *v)
+{
+	CFid *fid;
+	uchar *buf;
+	vlong n, sent, t0;
+
+	fid = v;
+	buf = malloc(MAXMSG);
+	if(buf == nil)
+		sysfatal("out of memory");
+	memset(buf, 'x', MAXMSG);
+	for(sent = 0; !stop && (permsgs == 0 || sent < permsgs); sent++){
+		n = msglen();
+		t0 = nsec();
+		put8(buf, t0);
+		buf[8] = n;
+		buf[9] = n>>8;
+		buf[10] = MAGIC0;
+		buf[11] = MAGIC1;
+		if(fswrite(fid, buf, n) != n){
+			werrors++;
+			break;
+		}
+		histadd(wlat, nsec() - t0);
+		writes++;
+		bytesin += n;
+	}
+	free(buf);
+	sendul(donec, 0);
+}
+
+/* whether p holds the header of a message written by this run */
+int
+ismsg(uchar *p, vlong now)
+{
+	long m;
+	vlong t;
+
+	m = p[8] | p[9]<<8;
+	t = get8(p);
+	return p[10] == MAGIC0 && p[11] == MAGIC1 && m >= HDR && m <= MAXMSG
+		&& t >= tstart && t <= now;
+}
+
+void
+reader(void *v)
+{
+	CFid *fid;
+	uchar *buf;
+	char err[ERRMAX];
+	long n, m, off, have;
+	vlong now;
+	int lost;
+
+	fid = v;
+	buf = malloc(MAXMSG + RBUF);
+	if(buf == nil)
+		sysfatal("out of memory");
+	have = 0;
+	lost = 0;
+	for(;;){
+		if((n = fsread(fid, buf+have, RBUF)) < 0){
+			rerrstr(err, sizeof err);
+			if(strstr(err, "gap") != nil){
+				gaps++;
+				have = 0;
+				lost = 1;
+				continue;
+			}
+			rerrors++;
+			break;
+		}
+		if(n == 0)
+			break;
+		now = nsec();
+		reads++;
+		bytesout += n;
+		n += have;
+		for(off = 0; off + HDR <= n; off += m){
+			if(!ismsg(buf+off, now)){
+				/* a lapped reader can land inside a message */
+				if(!lost)
+					gaps++;
+				lost = 1;
+				while(++off + HDR <= n && !ismsg(buf+off, now))
+					;
+				if(off + HDR > n)
+					break;
+			}
+			lost = 0;
+			m = buf[off+8] | buf[off+9]<<8;
+			if(off + m > n)
+				break;
+			histadd(dlat, now - get8(buf+off));
+			msgsout++;
+		}
+		/* the start of a message split between reads waits for the rest */
+		have = n - off;
+		memmove(buf, buf+off, have);
+	}
+	free(buf);
+	sendul(donec, 1);
+}
+
+/* stop the writers after the run time */
+void
+timerproc(void*)
+{
+	sleep(seconds*1000);
+	stop = 1;
+}
+
+/* keep sending eofs until every reader has caught up and left */
+void
+eofproc(void *v)
+{
+	CFid *ctl;
+	int i;
+
+	ctl = v;
+	while(!drained){
+		for(i = 0; i < nhubs && !drained; i++)
+			fsprint(ctl, "eof %s%d", prefix, i);
+		sleep(EOFMS);
+	}
+}
+
+void
+report(double secs)
+{
+	Fmt f;
+	char buf[1024];
+	vlong lost;
+
+	lost = writes*nreaders - msgsout;
+	fmtfdinit(&f, 1, buf, sizeof buf);
+	fmtprint(&f, "hubs %d\nwriters %d\nreaders %d\n", nhubs, nwriters, nreaders);
+	fmtprint(&f, "msgsize %d %s\n", msgsize, dists[dist]);
+	fmtprint(&f, "seconds %.3f\n", secs);
+	fmtprint(&f, "writes %lld\nbytesin %lld\n", writes, bytesin);
+	fmtprint(&f, "reads %lld\nmsgsout %lld\nbytesout %lld\n", reads, msgsout, bytesout);
+	fmtprint(&f, "writes/s %.0f\nreads/s %.0f\n", writes/secs, reads/secs);
+	fmtprint(&f, "MB/s.in %.2f\nMB/s.out %.2f\n", bytesin/secs/1e6, bytesout/secs/1e6);
+	fmtprint(&f, "lost %lld\ngaps %lld\nerrors %lld\n", lost, gaps, werrors+rerrors);
+	histprint(&f, "write", wlat);
+	histprint(&f, "delivery", dlat);
+	fmtfdflush(&f);
+}
+
+void
+threadmain(int argc, char **argv)
+{
+	CFid *ctl, **fids;
+	char name[64], *p;
+	int i, j, k, n, nw, nr;
+	vlong t0, t1;
+
+	ARGBEGIN{
+	case 'k':
+		keep = 1;
+		break;
+	case 'R':
+		record = 1;
+		break;
+	case 's':
+		srvname = EARGF(usage());
+		break;
+	case 'p':
+		prefix = EARGF(usage());
+		break;
+	case 'h':
+		nhubs = atoi(EARGF(usage()));
+		break;
+	case 'w':
+		nwriters = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		nreaders = atoi(EARGF(usage()));
+		break;
+	case 'm':
+		msgsize = atoi(EARGF(usage()));
+		break;
+	case 'd':
+		p = EARGF(usage());
+		for(dist = 0; dist < nelem(dists); dist++)
+			if(strcmp(dists[dist], p) == 0)
+				break;
+		if(dist == nelem(dists))
+			usage();
+		break;
+	case 't':
+		seconds = atoi(EARGF(usage()));
+		break;
+	case 'n':
+		permsgs = strtoll(EARGF(usage()), nil, 10);
+		break;
+	case 'c':
+		if(nctls == nelem(ctls))
+			usage();
+		ctls[nctls++] = EARGF(usage());
+		break;
+	default:
+		usage();
+	}ARGEND;
+	if(argc || nhubs < 1 || nwriters < 0 || nreaders < 0 || msgsize < HDR || msgsize > MAXMSG)
+		usage();
+
+	if((fs = nsmount(srvname, nil)) == nil)
+		sysfatal("mount %s: %r", srvname);
+	if((ctl = fsopen(fs, "ctl", ORDWR)) == nil)
+		sysfatal("open ctl: %r");
+	for(i = 0; i < nctls; i++)
+		if(fsprint(ctl, "%s", ctls[i]) < 0)
+			sysfatal("ctl %s: %r", ctls[i]);
+	tstart = nsec();
+	wlat = histalloc();
+	dlat = histalloc();
+	donec = chancreate(sizeof(ulong), 0);
+
+	/* readers open first so they see every message */
+	n = nhubs * (nreaders + nwriters);
+	fids = malloc(n * sizeof(CFid*));
+	if(fids == nil)
+		sysfatal("out of memory");
+	for(i = k = 0; i < nhubs; i++){
+		snprint(name, sizeof name, "%s%d", prefix, i);
+		if((fids[k] = fscreate(fs, name, OREAD, 0666)) != nil)
+			fsclose(fids[k]);
+		if(record && fsprint(ctl, "record %s", name) < 0)
+			sysfatal("record %s: %r", name);
+		for(j = 0; j < nreaders + nwriters; j++, k++)
+			if((fids[k] = fsopen(fs, name, j < nreaders ? OREAD : OWRITE)) == nil)
+				sysfatal("open %s: %r", name);
+	}
+
+	t0 = nsec();
+	proccreate(timerproc, nil, STACK);
+	for(k = 0; k < n; k++)
+		if(k % (nreaders + nwriters) < nreaders)
+			threadcreate(reader, fids[k], STACK);
+	for(k = 0; k < n; k++)
+		if(k % (nreaders + nwriters) >= nreaders)
+			threadcreate(writer, fids[k], STACK);
+
+	/* once the writers are done, drain the readers and stop the clock */
+	nw = nhubs * nwriters;
+	nr = nhubs * nreaders;
+	while(nw > 0)
+		if(recvul(donec) == 0)
+			nw--;
+		else
+			nr--;
+	proccreate(eofproc, ctl, STACK);
+	for(; nr > 0; nr--)
+		recvul(donec);
+	drained = 1;
+	t1 = nsec();
+
+	report((t1 - t0) / 1e9);
+	for(k = 0; k < n; k++)
+		fsclose(fids[k]);
+	if(!keep)
+		for(i = 0; i < nhubs; i++){
+			snprint(name, sizeof name, "%s%d", prefix, i);
+			fsremove(fs, name);
+		}
+	threadexitsall(nil);
+}
@@ -0,0 +1,259 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>
+#include "../ring.h"
+
+/*
+ * Microbenchmark of the hub ring core without 9p. Each test times
+ * a loop over the ring calls the server makes and prints ns/op and
+ * throughput as "key value" pairs, one test per line.
+ * bytes/cycle needs the clock rate, from -c or /proc/cpuinfo.
+*/
+
+enum{
+	MAXMSG = 64*1024,
+};
+
+typedef struct Test Test;
+
+struct Test{
+	char *name;
+	vlong (*fn)(void);			/* runs nops operations, returns bytes moved */
+};
+
+int msgsize = 512;
+uvlong ringsize = 777777;		/* same as the hubfs default */
+int nreaders = 4;
+vlong nops = 1000000;
+double mhz;
+char *msg;
+char *rbuf;
+
+/* the writer only */
+vlong
+tappend(void)
+{
+	Ring r;
+	vlong i;
+
+	ringinit(&r, ringsize);
+	for(i = 0; i < nops; i++)
+		ringappend(&r, msg, msgsize);
+	ringfree(&r);
+	return nops * msgsize;
+}
+
+/* every reader copies each message out, as in record mode */
+vlong
+tcopy(void)
+{
+	Ring r;
+	vlong i, off;
+	int j;
+
+	ringinit(&r, ringsize);
+	for(i = 0; i < nops; i++){
+		off = r.woff;
+		ringappend(&r, msg, msgsize);
+		for(j = 0; j < nreaders; j++)
+			ringcopy(&r, off, rbuf, msgsize);
+	}
+	ringfree(&r);
+	return nops * msgsize * (nreaders + 1);
+}
+
+/* every reader pins each message for a reply, as in normal mode */
+vlong
+tpin(void)
+{
+	Ring r;
+	Chunk *c;
+	vlong i, off, end;
+	u32int count;
+	int j;
+
+	ringinit(&r, ringsize);
+	for(i = 0; i < nops; i++){
+		ringappend(&r, msg, msgsize);
+		end = r.woff;
+		for(j = 0; j < nreaders; j++)
+			for(off = end - msgsize; off < end; off += count){
+				count = end - off;
+				ringpin(&r, off, &count, &c);
+				chunkput(c);
+			}
+	}
+	ringfree(&r);
+	return nops * msgsize * (nreaders + 1);
+}
+
+/*
+ * readers fall behind and are lapped by the writer over a ring of two
+ * chunks, so the tail moves on every append and readers skip ahead
+ */
+vlong
+twrap(void)
+{
+	Ring r;
+	vlong i, *roff, bytes;
+	long n;
+	int j;
+
+	roff = malloc(nreaders * sizeof(vlong));
+	if(roff == nil)
+		sysfatal("out of memory");
+	memset(roff, 0, nreaders * sizeof(vlong));
+	ringinit(&r, 2*CHUNK);
+	bytes = 0;
+	for(i = 0; i < nops; i++){
+		ringappend(&r, msg, msgsize);
+		for(j = 0; j < nreaders; j++){
+			/* reader j reads once every j+1 appends */
+			if(i % (j+1) != 0)
+				continue;
+			if(roff[j] < r.tail)
+				roff[j] = r.tail;
+			n = r.woff - roff[j];
+			if(n > MAXMSG)
+				n = MAXMSG;
+			ringcopy(&r, roff[j], rbuf, n);
+			roff[j] += n;
+			bytes += n;
+		}
+	}
+	ringfree(&r);
+	free(roff);
+	return nops * msgsize + bytes;
+}
+
+/* each message is dropped again, giving the chunks back */
+vlong
+ttrunc(void)
+{
+	Ring r;
+	vlong i;
+
+	ringinit(&r, ringsize);
+	for(i = 0; i < nops; i++){
+		ringappend(&r, msg, msgsize);
+		ringtrunc(&r, r.woff);
+	}
+	ringfree(&r);
+	return nops * msgsize;
+}
+
+/* as copy, but readers are a few chunks behind in compressed scrollback */
+vlong
+tzcopy(void)
+{
+	Ring r;
+	vlong i, off;
+	int j;
+
+	ringinit(&r, ringsize);
+	ringcompress(&r, CHUNK);
+	for(i = 0; i < nops; i++){
+		ringappend(&r, msg, msgsize);
+		off = r.woff - 4*CHUNK;
+		if(off < r.tail)
+			off = r.tail;
+		for(j = 0; j < nreaders; j++)
+			ringcopy(&r, off, rbuf, msgsize);
+	}
+	ringfree(&r);
+	return nops * msgsize * (nreaders + 1);
+}
+
+Test tests[] = {
+	{"append", tappend},
+	{"copy", tcopy},
+	{"pin", tpin},
+	{"wrap", twrap},
+	{"trunc", ttrunc},
+	{"zcopy", tzcopy},
+};
+
+/* the clock rate from /proc/cpuinfo, 0 if unknown */
+double
+cpumhz(void)
+{
+	char buf[8192], *p;
+	int fd;
+	long n;
+
+	if((fd = open("/proc/cpuinfo", OREAD)) < 0)
+		return 0;
+	n = readn(fd, buf, sizeof buf - 1);
+	close(fd);
+	if(n <= 0)
+		return 0;
+	buf[n] = '\0';
+	if((p = strstr(buf, "cpu MHz")) == nil || (p = strchr(p, ':')) == nil)
+		return 0;
+	return atof(p+1);
+}
+
+void
+usage(void)
+{
+	fprint(2, "usage: %s [-m msgsize] [-s ringsize] [-r readers] [-n ops] [-c cpumhz] [test...]\n", argv0);
+	threadexitsall("usage");
+}
+
+void
+threadmain(int argc, char **argv)
+{
+	Test *t;
+	vlong t0, ns, bytes;
+	int i;
+
+	ARGBEGIN{
+	case 'm':
+		msgsize = atoi(EARGF(usage()));
+		break;
+	case 's':
+		ringsize = strtoull(EARGF(usage()), nil, 10);
+		break;
+	case 'r':
+		nreaders = atoi(EARGF(usage()));
+		break;
+	case 'n':
+		nops = strtoll(EARGF(usage()), nil, 10);
+		break;
+	case 'c':
+		mhz = atof(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND;
+	if(msgsize < 1 || msgsize > MAXMSG || ringsize < msgsize || nreaders < 0 || nops < 1)
+		usage();
+	if(mhz == 0)
+		mhz = cpumhz();
+	msg = malloc(MAXMSG);
+	rbuf = malloc(MAXMSG);
+	if(msg == nil || rbuf == nil)
+		sysfatal("out of memory");
+	memset(msg, 'x', MAXMSG);
+
+	for(t = tests; t < tests + nelem(tests); t++){
+		if(argc > 0){
+			for(i = 0; i < argc; i++)
+				if(strcmp(argv[i], t->name) == 0)
+					break;
+			if(i == argc)
+				continue;
+		}
+		t0 = nsec();
+		bytes = t->fn();
+		ns = nsec() - t0;
+		if(ns <= 0)
+			ns = 1;
+		print("test %s msgsize %d readers %d ops %lld ns/op %.1f MB/s %.1f",
+			t->name, msgsize, nreaders, nops, (double)ns/nops, bytes*1e3/ns);
+		if(mhz > 0)
+			print(" bytes/cycle %.3f", bytes*1e3/(ns*mhz));
+		print("\n");
+	}
+	threadexitsall(nil);
+}
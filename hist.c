@@ -0,0 +1,97 @@
+#include <u.h>
+#include <libc.h>
+#include "hist.h"
+
+/*
+ * Values below HSUB get a bucket each, above that every power of two
+ * is split into HSUB buckets, so recording is a few shifts and an add
+ * and percentiles are accurate to a bucket width, about 6%.
+*/
+
+Hist*
+histalloc(void)
+{
+	Hist *h;
+
+	h = malloc(sizeof(Hist));
+	if(!h)
+		sysfatal("out of memory");
+	histreset(h);
+	return h;
+}
+
+static int
+bucket(vlong v)
+{
+	int e;
+
+	if(v < HSUB)
+		return v < 0 ? 0 : v;
+	for(e = 0; (v >> e) >= 2*HSUB; e++)
+		;
+	return (e+1)*HSUB + (v >> e) - HSUB;
+}
+
+/* the largest value that falls in bucket i */
+static vlong
+bucketmax(int i)
+{
+	int e;
+
+	if(i < HSUB)
+		return i;
+	e = i/HSUB - 1;
+	return ((vlong)(i%HSUB + HSUB + 1) << e) - 1;
+}
+
+void
+histadd(Hist *h, vlong v)
+{
+	h->count[bucket(v)]++;
+	h->n++;
+	h->sum += v;
+	if(v > h->max)
+		h->max = v;
+}
+
+/* the value below which pct of the recorded values fall, pct between 0 and 1 */
+vlong
+histpct(Hist *h, double pct)
+{
+	vlong rank, seen;
+	int i;
+
+	if(h->n == 0)
+		return 0;
+	rank = pct * h->n;
+	if(rank >= h->n)
+		rank = h->n - 1;
+	seen = 0;
+	for(i = 0; i < NHIST; i++){
+		seen += h->count[i];
+		if(seen > rank)
+			break;
+	}
+	if(bucketmax(i) > h->max)
+		return h->max;
+	return bucketmax(i);
+}
+
+void
+histreset(Hist *h)
+{
+	memset(h, 0, sizeof(Hist));
+}
+
+/* one line of name, count, mean, percentiles and max, in nanoseconds */
+void
+histprint(Fmt *f, char *name, Hist *h)
+{
+	if(h == nil || h->n == 0){
+		fmtprint(f, "hist %s count 0 mean 0 p50 0 p90 0 p99 0 p999 0 max 0\n", name);
+		return;
+	}
+	fmtprint(f, "hist %s count %lld mean %lld p50 %lld p90 %lld p99 %lld p999 %lld max %lld\n",
+		name, h->n, h->sum / h->n, histpct(h, 0.5), histpct(h, 0.9),
+		histpct(h, 0.99), histpct(h, 0.999), h->max);
+}
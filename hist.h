@@ -0,0 +1,20 @@
+enum{
+	HSUBBITS = 4,
+	HSUB = 1<<HSUBBITS,			/* Buckets for each power of two, about 6% apart */
+	NHIST = (65-HSUBBITS)*HSUB,	/* Enough buckets for any positive vlong */
+};
+
+typedef struct Hist Hist;		/* Log-linear histogram of nanosecond latencies */
+
+struct Hist{
+	vlong n;					/* Values recorded */
+	vlong sum;
+	vlong max;
+	ulong count[NHIST];
+};
+
+Hist* histalloc(void);
+void histadd(Hist *h, vlong v);
+vlong histpct(Hist *h, double pct);
+void histreset(Hist *h);
+void histprint(Fmt *f, char *name, Hist *h);
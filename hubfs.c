@@ -6,274 +6,1935 @@
 #include <9p.h>
 #include <ctype.h>
 #include "ratelimit.h"
+#include "journal.h"
+#include "hist.h"
+#include "ring.h"
 
 /* input/output multiplexing and buferring */
 /* often used in combination with hubshell client and hub wrapper script */
 
 enum {
-	MAGIC = 77777,				/* In paranoid mode let readers lag this many bytes */
-	MAXQ = 777,					/* Maximum number of 9p requests to queue */
 	SMBUF = 777,				/* Buffer for names and other small strings */
-	MAXHUBS = 77,				/* Total number of hubs that can be created */
+	NHASH = 64,					/* Initial size of the hub name hash table */
+	TICK = 1,					/* Milliseconds between scheduling rounds while reads are held */
+	STACK = 8192,				/* Stack size of the ticker and worker procs */
+	NWORKQ = 64,				/* Requests that can wait for a busy worker proc */
+	QUANTUM = CHUNK,			/* Bytes per unit of weight granted in a scheduling round */
+	NCOHORT = 8,				/* Reader positions one msgsend pass shares replies among, a power of 2 */
+	FRAMEHDR = 12,				/* Sequence number and length before the data of each frame */
+	NMUXHASH = 64,				/* Size of the mux hash table, a power of 2 */
 };
 
+#define MAXOFF ((vlong)(~0ULL>>1))	/* Larger than any stream offset */
+
+/* plan9port's lib9p names the Ref and Dir a File is made of */
+#ifdef PLAN9PORT
+#define filedir(f)	(&(f)->dir)
+#define fileref(f)	(&(f)->ref)
+#else
+#define filedir(f)	(&(f)->Dir)
+#define fileref(f)	(&(f)->Ref)
+#endif
+
 typedef struct Hub	Hub;		/* A Hub file is a multiplexed pipe-like data buffer */
 typedef struct Msgq	Msgq;		/* Client fid structure to track location */
+typedef struct Qent	Qent;		/* Queue entry, hangs off the aux of its Req */
+typedef struct Wstamp	Wstamp;		/* When a write was stored */
+typedef struct Alarm	Alarm;		/* Proc sleeping until the ticker is next due */
+typedef struct Cohort	Cohort;		/* Readers at one offset, sent one reply */
+typedef struct Rec	Rec;		/* Where a write starts in record mode */
+
+enum {
+	Lstore,						/* write queued to stored */
+	Lfirst,						/* write stored to first read by any reader */
+	Llast,						/* write stored to read by every reader */
+	Lqueued,					/* read queued to answered */
+	NLAT,
+};
+
+/* queues of waiting Reqs are circular lists headed by an unused Qent */
+struct Qent{
+	Req *r;						/* the waiting request */
+	Hub *h;						/* hub it waits on */
+	vlong t;					/* time it was queued, when timing */
+	Qent *prev;
+	Qent *next;
+};
+
+struct Wstamp{
+	vlong off;					/* stream offset of the first byte of the write */
+	vlong t;					/* time it was stored */
+};
+
+/* an alarm proc given a deadline sleeps until then and wakes the ticker */
+struct Alarm{
+	vlong t;					/* deadline it sleeps until, 0 while idle */
+	Channel *c;					/* deadlines are sent here */
+	Alarm *next;
+};
+
+struct Rec{
+	vlong off;					/* stream offset of the first byte of the write */
+	vlong seq;					/* its place among the writes to all hubs */
+};
+
+/* readers at the same offset asking for the same count get the same bytes, built once */
+struct Cohort{
+	vlong off;					/* stream offset of the reply, -1 if the entry is unused */
+	u32int want;				/* count the readers asked for */
+	int framed;					/* the reply is in frames, for the seq file */
+	u32int count;				/* bytes in the reply */
+	vlong adv;					/* stream bytes it holds */
+	char *data;					/* the reply, in a chunk or in the buffer of lead */
+	Chunk *c;					/* chunk pinned for the reply, nil if it was copied */
+	Req *lead;					/* read holding the copied reply, answered after the others */
+};
 
 struct Hub{
+	Ref;						/* the hub file and its side files */
 	char name[SMBUF];			/* name */
-	char *bucket;				/* pointer to data buffer */
-	char *inbuckp;				/* location to store next message */
-	int buckfull;				/* amount of data stored in bucket */
-	char *buckwrap;				/* exact limit of written data before pointer reset */
-	Req *qreads[MAXQ];			/* pointers to queued read Reqs */
-	int rwaiting[MAXQ];			/* status of read requests */
-	int qrnum;					/* index of read Reqs waiting to be filled */
-	int qrans;					/* number of read Reqs answered */
-	Req *qwrites[MAXQ];			/* Similar for write Reqs */
-	int wwaiting[MAXQ];
-	int qwnum;
-	int qwans;
-	int ketchup;				/* lag of readers vs. writers in paranoid mode */
-	int tomatoflag;				/* readers use tomatoflag to tell writers to wait */
-	QLock wrlk;					/* writer lock during fear */
-	QLock replk;				/* reply lock during fear */
-	int suicidal;				/* forked processes in paranoid mode need to exit */
+	File *posf;					/* name.pos, read at stream offsets, nil if none */
+	File *statf;				/* name.stats, nil if none */
+	File *seqf;					/* name.seq, read as frames of numbered writes, nil if none */
+	QLock lk;					/* held while a request or the ticker works on the hub */
+	Channel *wc;				/* worker proc serving the hub, nil without -p */
+	Ring;						/* stored data, woff and tail are its stream offsets */
+	int lapmode;				/* what to do with readers lapped by writers */
+	int paranoid;				/* writes wait until readers have room for them */
+	int frozen;					/* the hub behaves as a plain file */
+	int trunc;					/* new readers start at the newest data */
+	int records;				/* reads return whole writes only */
+	int numbered;				/* the seq file was opened, writes are numbered */
+	vlong lastseq;				/* number of the newest numbered write, the seq file's length */
+	int ismux;					/* a name.mux file, fed the writes to the hubs whose names start with name */
+	Hub **muxes;				/* muxes fed the writes to this hub */
+	int nmuxes;
+	Hub **members;				/* hubs feeding this mux */
+	int nmembers;
+	Hub *mnext;					/* Next mux in the same mux hash chain */
+	Rec *rec;					/* ring of where writes start, oldest first */
+	int nrec;					/* size of the ring, a power of 2 */
+	int rfirst;					/* index of the oldest record start */
+	int nrecs;					/* record starts held */
+	vlong cwindow;				/* ns that small writes may be held back from readers */
+	long cbytes;				/* held bytes that wake the readers early, 0 for none */
+	vlong cdue;					/* time the held writes must be sent, 0 if none held */
+	vlong woke;					/* woff when readers were last woken */
+	vlong minwant;				/* offset at which some queued read could be filled */
+	int armed;					/* on the list of hubs watched by the ticker */
+	Qent ready;					/* read Reqs with data they can be sent */
+	Qent idle;					/* read Reqs that have caught up and wait for writes */
+	Qent wq;					/* write Reqs waiting to be stored */
+	Qent held;					/* read Reqs with data waiting for bandwidth */
+	int sheld;					/* some read is held, the ticker's rounds grant bandwidth */
+	int weight;					/* share of the server budget, relative to other hubs */
+	int shared;					/* given a weight by ctl, so the budget applies to it */
+	vlong cap;					/* bytes per second the hub may send, 0 for no cap */
+	vlong ctok;					/* bytes the cap allows now */
+	vlong deficit;				/* bytes granted by scheduling rounds and not yet sent */
+	int ncaps;					/* readers with their own cap */
+	int nqr;					/* number of read Reqs queued */
+	int nqw;					/* number of write Reqs queued */
+	vlong bytesin;				/* counters for the stats files */
+	vlong nwrites;
+	vlong bytesout;
+	vlong nreads;
+	vlong overruns;				/* times readers were lapped */
+	vlong gapbytes;				/* bytes lapped readers lost */
+	vlong nshared;				/* reads answered with a reply built for another reader */
+	Hist *lat[NLAT];			/* latency histograms, allocated when first used */
+	Wstamp *ws;					/* ring of store times of writes not yet read by every reader */
+	int nws;					/* size of the ring, a power of 2 */
+	int wsfirst;				/* index of the oldest stamp */
+	int nstamps;				/* stamps held */
+	int nfirst;					/* the oldest this many have been read by some reader */
+	int nlast;					/* and this many by every reader */
+	Qent *freeq;				/* recycled queue entries */
+	int eof;					/* the next msgsend sends an end of file to every reader */
+	Msgq *readers;				/* clients that opened the hub for reading */
+	vlong fdue;					/* time held writes are rechecked for idle readers, 0 if none */
+	vlong ldue;					/* time the rate limiter lets the next held write in, 0 if none */
 	Limiter *lp;				/* Pointer to limiter struct for this hub */
+	Journal *jp;				/* On-disk copy of the hub, nil without -j */
+	vlong jdue;					/* time batched journal bytes must be written, 0 if none */
 	vlong bp;					/* Bytes per second that can be written */
 	vlong st;					/* minimum separation time between messages in ns */
 	vlong rt;					/* Interval in seconds for resetting limit timer */
 	Hub *next;					/* Next hub in list */
+	Hub *prev;					/* Previous hub in list */
+	Hub *hnext;					/* Next hub in the same hash chain */
+	Hub *anext;					/* Next hub watched by the ticker */
+	Hub *aprev;
+	Hub *dnext;					/* Next hub waiting to be freed */
 };
 
 struct Msgq{
 	ulong myfid;				/* Msgq is associated with client fids */
-	char *nxt;					/* Location of this client in the buffer */
-	int bufuse;					/* how much of the buffer has been used */
+	vlong roff;					/* stream offset of the next byte for this client */
+	vlong lastread;				/* time of the client's latest read, for paranoid mode */
+	vlong seqsent;				/* newest write number sent to a seq file reader */
+	int weight;					/* share of the hub's bandwidth, relative to its other readers */
+	vlong cap;					/* bytes per second the client may be sent, 0 for no cap */
+	vlong ctok;					/* bytes the cap allows now */
+	vlong deficit;				/* bytes granted by scheduling rounds and not yet sent */
+	int dead;					/* the fid is gone, free this at the next reap */
+	Hub *h;						/* hub being read, nil for write only clients */
+	Msgq *next;					/* other readers of the same hub */
+	Msgq *prev;
+	Msgq *dnext;				/* next client waiting to be freed */
 };
 
 char *srvname;					/* Name of this hubfs service */
 Hub *firsthub;
 Hub *lasthub;
+Hub **hubtab;					/* Hubs hashed by name */
+Hub *muxtab[NMUXHASH];			/* Muxes hashed by their name less .mux */
+int nhubtab;					/* Size of hubtab, always a power of 2 */
+RWLock reglk;					/* Write locked to add or free hubs, read locked to use them */
+QLock armlk;					/* Protects the armed list and the alarms */
+Hub *armed;						/* Hubs holding writes back from their readers */
+Alarm *alarms;					/* Every alarm proc, idle ones included */
+Channel *tickc;					/* Alarms wake the ticker here */
+Lock deadlk;					/* Protects the dead lists, which can be added to under a hub lock */
+QLock reaplk;					/* One proc at a time frees the dead */
+Hub *deadhubs;					/* Destroyed hubs to free at the next reap */
+Msgq *deadmqs;					/* Clients of clunked fids to free at the next reap */
+Channel **workc;				/* Request channels of the worker procs */
+File *statsfile;				/* Statistics of all hubs */
+int nworkers;					/* Number of worker procs, 0 to serve in the 9p loop */
 int nhubs;						/* Total number of hubs in existence */
-int paranoid;					/* Paranoid mode maintains loose reader/writer sync */
-int frozen;						/* When frozen, the hubs operate simply as a ramfs */
-int trunc;						/* In trunc mode only new data is sent, not buffered */
+int paranoid;					/* Paranoid mode holds writes until readers have room, for new hubs */
+int quorum;						/* Readers that must have room for a paranoid write, 0 for all */
+vlong idletime;					/* Seconds without a read before writers stop waiting on a reader */
+int frozen;						/* When frozen, new hubs operate simply as a ramfs */
+int trunc;						/* In trunc mode new hubs only send new data, not buffered */
+int lapmode;					/* Default handling of lapped readers for new hubs */
+int recmode;					/* Whether new hubs keep write boundaries */
+int timing;						/* Whether latencies are recorded */
+vlong coalwindow;				/* Default microseconds to hold small writes */
+long coalbytes;					/* Default bytes that end the holding early */
 int allowzap;					/* Determine whether a buffer can be emptied forcibly */
-int endoffile;					/* Send zero length end of file read to all clients */
 int applylimits;				/* Whether time/rate limits are applied */
+vlong budget;					/* Bytes per second all hubs together may send, 0 for no limit */
+vlong btok;						/* bytes of the budget not yet granted */
+vlong lastround;				/* time of the latest scheduling round */
+int rrnext;						/* armed hub the next round starts at, so none is always last */
+int hubweight;					/* Weight of new hubs */
+int hubshared;					/* A weight was given for all hubs, new ones share the budget too */
+vlong hubcap;					/* Cap of new hubs */
+char *jdir;						/* Directory holding the hub journals, nil for none */
+int jmode;						/* Durability of journal writes */
 vlong bytespersecond;			/* Bytes per second allowed by rate limiting */
 vlong separationinterval;		/* Minimum time between writes in nanoseconds */
 vlong resettime;				/* Number of seconds between writes ratelimit reset */
 u32int maxmsglen;				/* Maximum message length accepted */
-uvlong bucksize;					/* Size of data bucket per hub */
+Lock budlk;						/* Protects budget and btok, set by ctl while the ticker grants */
+Lock seqlk;						/* Protects wseq, hubs on different workers write at once */
+vlong wseq;						/* Sequence number of the latest numbered write */
+uvlong bucksize;					/* Size of data bucket of new hubs */
+uvlong comphot;					/* Bytes new hubs keep uncompressed, 0 to compress nothing */
 
 static char Ebad[] = "something bad happened";
 static char Ebadctl[] = "bad ctl message";
 static char Enomem[] = "no memory";
-static char Etoomany[] = "too many hubs";
+static char Enohub[] = "hub not found";
+static char Ebeyond[] = "offset beyond end of stream";
+static char Eposrm[] = "remove the hub, not its side files";
+static char Estatsrm[] = "the stats file cannot be removed";
+static char Ebadstats[] = "stats files only take reset";
+static char Enoclient[] = "no reader with that fid";
+static char Eframesmall[] = "read too small for a frame";
+static char Emuxwrite[] = "mux files are written through their member hubs";
+
+enum {
+	Lapskip,					/* lapped readers skip ahead to the oldest data */
+	Lapgap,						/* lapped readers get a gap error, then skip */
+};
 
 void wrsend(Hub*);
 void msgsend(Hub*);
+void cohortdone(Cohort*);
 char* hubctl(char*);
 void setuphub(Hub*);
 void addhub(Hub*);
 void unlinkhub(Hub*);
+uint hashname(char*);
+void growhubtab(void);
 char* eofhub(char*);
+void hubeof(Hub*);
+char* laphub(char*, int);
+Hub* findhub(char*);
+void hubappend(Hub*, char*, long);
+void hubzap(Hub*);
+void hubjournal(Hub*, char*, long);
+void hubjtail(Hub*);
+void jfail(Hub*);
+void jsyncall(void);
+void recoverhubs(void);
+void recoverhub(char*);
+int hubroom(Hub*, long);
+void flowhubs(void);
+void freemq(Msgq*);
 void hubqueue(Hub*, Req*);
-int flushinated(Hub*, Req*);
+vlong reqoff(Hub*, Req*);
+void recpush(Hub*, vlong, vlong);
+vlong newseq(Hub*);
+vlong recseq(Hub*, vlong);
+void putframe(uchar*, vlong, long);
+int ismuxof(Hub*, Hub*);
+void muxlink(Hub*);
+void muxjoin(Hub*, Hub*);
+void muxunlink(Hub*);
+void muxdrop(Hub***, int*, Hub*);
+Hub** muxchain(Hub*);
+void muxappend(Hub*, char*, long, vlong);
+vlong recat(Hub*, int);
+int recfind(Hub*, vlong);
+long framefill(Hub*, vlong, char*, long, long, vlong*);
+vlong recfirst(Hub*);
+void rectrim(Hub*);
+long recspan(Hub*, vlong, long);
+char* rechub(char*, int);
+void hubsetlen(Hub*, File*);
+void hubrelen(Hub*);
+File* mkside(Hub*, File*, char*, char*, ulong);
+void hublat(Hub*, int, vlong);
+void stamppush(Hub*, vlong, vlong);
+Wstamp* stampat(Hub*, int);
+void stamptrim(Hub*);
+void stampfirst(Hub*, vlong, vlong);
+void stamplast(Hub*, vlong);
+char* timehub(int);
+void qmove(Qent*, Qent*);
+int isside(Hub*, File*);
+void hubstats(Hub*, Fmt*);
+void allstats(Fmt*);
+int coalesce(Hub*);
+void armhub(Hub*);
+void disarmhub(Hub*);
+vlong hubdue(Hub*);
+void alarmfor(vlong);
+void alarmproc(void*);
+char* coalhub(char*);
+char* sharehub(char*, int);
+char* modehub(char*, int);
+void hubmode(Hub*, int);
+char* sizehub(char*);
+char* comphub(char*);
+char* limithub(char*);
+void hublimit(Hub*, vlong, vlong, vlong);
+char* budgethub(char*);
+int hubsched(Hub*);
+vlong hubgrant(Hub*, Msgq*);
+void hubcharge(Hub*, Msgq*, vlong);
+void schedule(Hub**, int, vlong);
+void ticker(void*);
+void reap(void);
+void dispatch(Req*);
+void serve(Req*);
+void worker(void*);
+Hub* reqhub(Req*);
+int isctl(Hub*);
+void freehub(Hub*);
+void qinit(Qent*);
+int qempty(Qent*);
+void qsplice(Qent*, Qent*);
+void reqenq(Qent*, Hub*, Req*);
+Req* reqdeq(Qent*);
 
 void fsread(Req *r);
 void fswrite(Req *r);
 void fscreate(Req *r);
 void fsopen(Req *r);
 void fsflush(Req *r);
+void fsremove(Req *r);
 void fsdestroyfile(File *f);
+void fsdestroyfid(Fid *f);
 void usage(void);
 
 Srv fs = {
-	.open = fsopen,
-	.read = fsread,
-	.write = fswrite,
-	.create = fscreate,
-	.flush = fsflush,
+	.open = dispatch,
+	.read = dispatch,
+	.write = dispatch,
+	.create = dispatch,
+	.flush = dispatch,
+	.remove = dispatch,
+	.destroyfid = fsdestroyfid,
 };
 
 /*
  * Rate limiting is only applied if specified by flags.
  * The limiting parameters are global for the hubfs.
  * Each hubfile tracks its own limits separately.
+ * A write over the limit stays queued until the ticker lets it in,
+ * so other hubs are served meanwhile.
 */
 
 /*
  * Basic logic - we have a buffer/bucket of data (a hub) that is mapped to a file.
  * For each hub we keep two queues of 9p requests, one for reads and one for writes.
  * As requests come in, we add them to the queue, then fill waiting queued requests.
- * The data buffers are statically sized at creation. Data is continuously read
- * and written in a rotating pattern. At the end, we wrap back around to the start. 
+ * The data buffers are rings of fixed size chunks allocated as data arrives, up to
+ * a total of bucksize, see ring.c. Data is continuously read and written in a rotating
+ * pattern; once the hub is full the oldest chunk is reused to hold the newest data.
  * Our job is accurately transferring the bytes in and out of the bucket and 
  * tracking the location of the read and write pointers for each writer and reader. 
+ * Locations are kept as 64 bit stream offsets that only ever grow, so we can
+ * tell exactly when writers have wrapped around past a slow reader.
 */
 
-/* msgsend replies to Reqs queued by fsread */
+/* store n bytes at the write offset, keeping the journal in step */
+void
+hubappend(Hub *h, char *data, long n)
+{
+	if(h->jp != nil)
+		hubjournal(h, data, n);
+	ringappend(h, data, n);
+	if(h->jp != nil)
+		jtrim(h->jp, h->tail);
+}
+
+/* drop all stored data and give the chunks back */
+void
+hubzap(Hub *h)
+{
+	ringtrunc(h, h->woff);
+	rectrim(h);
+	hubjtail(h);
+}
+
+/*
+ * copy data written to the hub to its journal. Batched bytes are written
+ * by the ticker in periodic mode. A journal that fails is given up.
+ */
+void
+hubjournal(Hub *h, char *data, long n)
+{
+	if(jappend(h->jp, data, n, jmode) < 0){
+		jfail(h);
+		return;
+	}
+	if(jmode == Jperiodic && h->jp->nbuf > 0 && h->jdue == 0){
+		h->jdue = nsec() + JPERIOD*1000000LL;
+		armhub(h);
+	}
+}
+
+/* the hub dropped its data some other way than wrapping, the journal must too */
+void
+hubjtail(Hub *h)
+{
+	if(h->jp != nil && jtail(h->jp, h->tail) < 0)
+		jfail(h);
+}
+
+void
+jfail(Hub *h)
+{
+	fprint(2, "hubfs: journal of %s: %r\n", h->name);
+	jclose(h->jp);
+	h->jp = nil;
+}
+
+/* write out every batched journal byte, before quitting */
+void
+jsyncall(void)
+{
+	Hub *h;
+
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		if(h->jp != nil && jflush(h->jp) < 0)
+			jfail(h);
+		qunlock(&h->lk);
+	}
+}
+
+/* rebuild the hubs found in the journal directory at startup */
+void
+recoverhubs(void)
+{
+	Dir *d;
+	int fd, i, n;
+
+	if(access(jdir, AEXIST) < 0){
+		if((fd = create(jdir, OREAD, DMDIR|0775)) < 0)
+			sysfatal("create %s: %r", jdir);
+		close(fd);
+	}
+	if((fd = open(jdir, OREAD)) < 0)
+		sysfatal("open %s: %r", jdir);
+	n = dirreadall(fd, &d);
+	close(fd);
+	for(i = 0; i < n; i++)
+		if(d[i].mode & DMDIR)
+			recoverhub(d[i].name);
+	free(d);
+}
+
+/*
+ * make a hub from its journal. The retained bytes are read straight
+ * into the chunks, they do not go through the write path again.
+ */
+void
+recoverhub(char *name)
+{
+	Hub *h;
+	File *f;
+	Journal *j;
+	vlong off;
+	long m;
+	char *p;
+
+	if((j = jopen(jdir, name, 0)) == nil){
+		fprint(2, "hubfs: journal of %s: %r\n", name);
+		return;
+	}
+	if((f = createfile(fs.tree->root, name, getuser(), 0666, nil)) == nil){
+		fprint(2, "hubfs: cannot recover %s: %r\n", name);
+		jclose(j);
+		return;
+	}
+	h = emalloc9p(sizeof(*h));
+	setuphub(h);
+	strecpy(h->name, h->name+sizeof(h->name), name);
+	h->jp = j;
+	off = j->start;
+	if(j->woff - off > h->size)
+		off = j->woff - h->size;
+	h->woff = h->tail = off;
+	while(h->woff < j->woff){
+		m = CHUNK;
+		if(m > j->woff - h->woff)
+			m = j->woff - h->woff;
+		p = ringspace(h, &m);
+		if(jread(j, h->woff, p, m) != m){
+			fprint(2, "hubfs: journal of %s is short at %lld: %r\n", name, h->woff);
+			break;
+		}
+		ringcommit(h, m);
+	}
+	/* anything unreadable is left out of the stream for good */
+	off = h->woff;
+	h->woke = off;
+	if(off < j->woff){
+		j->woff = off;
+		jfail(h);
+	}
+	f->aux = h;
+	incref(h);
+	h->posf = mkside(h, fs.tree->root, getuser(), "pos", 0444);
+	h->statf = mkside(h, fs.tree->root, getuser(), "stats", 0644);
+	h->seqf = mkside(h, fs.tree->root, getuser(), "seq", 0444);
+	hubsetlen(h, f);
+	wlock(&reglk);
+	addhub(h);
+	muxlink(h);
+	wunlock(&reglk);
+	closefile(f);
+}
+
+/*
+ * msgsend replies to Reqs queued by fsread.
+ * Readers with data to take wait on the ready list, caught up readers on the
+ * idle list. New data or an eof moves all of the idle ones over in one step,
+ * so we only visit readers that can make progress. Caught up readers mostly
+ * sit at the same offset, so they are grouped into cohorts and the reply is
+ * pinned or copied once for each cohort rather than once for each reader.
+ */
 void
 msgsend(Hub *h)
 {
 	Req *r;
 	Msgq *mq;
+	Qent *e;
+	Chunk *c;
+	Cohort cohort[NCOHORT], *co;
 	u32int count;
-	int i;
-
-	if(h->qrnum == 0)
-		return;
+	long m;
+	vlong off, skip, now, lim, adv, seq;
+	int i, pos, framed, sched, held;
+	char gaperr[ERRMAX];
+
+	now = 0;
+	sched = hubsched(h);
+	held = 0;
+	for(i = 0; i < NCOHORT; i++){
+		cohort[i].off = -1;
+		cohort[i].c = nil;
+		cohort[i].lead = nil;
+	}
+	/* reads held for bandwidth go first */
+	if(!qempty(&h->held)){
+		qsplice(&h->held, &h->ready);
+		qsplice(&h->ready, &h->held);
+	}
+	if(h->woff != h->woke || h->eof){
+		qsplice(&h->ready, &h->idle);
+		h->minwant = MAXOFF;
+	}
+	/* whatever was held back goes out now */
+	h->woke = h->woff;
+	h->cdue = 0;
 
-	/* loop through queued 9p read requests for this hub and answer if needed */
-	for(i = h->qrans; i <= h->qrnum; i++){
-		if(paranoid)
-			qlock(&h->replk);
-		if(! h->rwaiting[i]){
-			if((i == h->qrans) && (i < h->qrnum))
-				h->qrans++;
-			if(paranoid)
-				qunlock(&h->replk);
-			continue;
-		}
+	/* answer the ready 9p read requests for this hub */
+	while(!qempty(&h->ready)){
+		e = h->ready.next;
 
 		/* request found, if it has read all data keep it waiting unless eof sent */
-		r = h->qreads[i];
+		r = e->r;
 		mq = r->fid->aux;
-		if(mq->nxt == h->inbuckp){
-			if(paranoid)
-				qunlock(&h->replk);
-			if(endoffile){
+		pos = r->fid->file == h->posf;
+		framed = r->fid->file == h->seqf;
+		off = reqoff(h, r);
+
+		/*
+		 * if writers have lapped the reader, its data is gone, say so or skip ahead.
+		 * position file readers always get the gap, they resume past it themselves.
+		 * in record mode the gap runs on to the next whole record.
+		 */
+		if(off < h->tail){
+			skip = h->records ? recfirst(h) : h->tail;
+			snprint(gaperr, sizeof(gaperr), "gap of %lld bytes", skip - off);
+			h->overruns++;
+			h->gapbytes += skip - off;
+			if(!pos)
+				off = mq->roff = skip;
+			if(pos || h->lapmode == Lapgap){
+				reqdeq(e);
+				respond(r, gaperr);
+				continue;
+			}
+		}
+		if(off == h->woff){
+			if(h->eof){
+				reqdeq(e);
 				r->ofcall.count = 0;
-				h->rwaiting[i] = 0;
-				if((i == h->qrans) && (i < h->qrnum))
-					h->qrans++;
 				respond(r, nil);
-				continue;
+			} else if(framed && mq->seqsent < h->lastseq && r->ifcall.count >= FRAMEHDR){
+				/*
+				 * a seq reader that has caught up is told the newest number in an
+				 * empty frame, so it knows no earlier write of this hub is to come.
+				 */
+				putframe((uchar*)r->ofcall.data, h->lastseq, 0);
+				mq->seqsent = h->lastseq;
+				reqdeq(e);
+				r->ofcall.count = FRAMEHDR;
+				respond(r, nil);
+			} else {
+				/* back to the idle list, without losing the time it was queued */
+				qmove(&h->idle, e);
+				if(off + r->ifcall.count < h->minwant)
+					h->minwant = off + r->ifcall.count;
 			}
 			continue;
 		}
+		/* if reader asks for more data than remains in bucket, adjust down */
 		count = r->ifcall.count;
-
-		/* if the mq has read to the wrap point, send it back to start */
-		if(mq->nxt >= h->buckwrap){
-			mq->nxt = h->bucket;
-			mq->bufuse = 0;
+		if(count > h->woff - off)
+			count = h->woff - off;
+
+		/* under bandwidth scheduling a reply may only use what the ticker has granted */
+		co = &cohort[(off + r->ifcall.count) & (NCOHORT-1)];
+		if(sched && (lim = hubgrant(h, mq)) < count){
+			if(h->records && !framed && recspan(h, off, count) != 0 && recspan(h, off, lim) == 0)
+				lim = 0;
+			if(lim <= 0){
+				qmove(&h->held, e);
+				held = 1;
+				continue;
+			}
+			count = lim;
+			co = nil;
 		}
-		/* if the mq next read would go past wrap point, read up to wrap */
-		if(mq->nxt + count > h->buckwrap)
-			count = h->buckwrap - mq->nxt;
-		/* if reader asks for more data than remains in bucket, adjust down */
-		if((mq->bufuse + count > h->buckfull) && (mq->bufuse < h->buckfull))
-			count = h->buckfull - mq->bufuse;
 
-		/* Done with reader location and count checks, now we can send the data */
-		memmove(r->ofcall.data, mq->nxt, count);
+		/* Done with reader location and count checks, share the cohort's reply if it has one */
+		c = nil;
+		if(co != nil && (co->off != off || co->want != r->ifcall.count || co->framed != framed))
+			cohortdone(co);
+		if(co != nil && co->off == off){
+			r->ofcall.data = co->data;
+			count = co->count;
+			adv = co->adv;
+			h->nshared++;
+		} else {
+			adv = count;
+			if(framed){
+				/* each write goes out behind its sequence number */
+				if((count = framefill(h, off, r->ofcall.data, r->ifcall.count, count, &adv)) == 0){
+					reqdeq(e);
+					respond(r, Eframesmall);
+					continue;
+				}
+			} else if(h->records){
+				/*
+				 * whole records may cross chunks, so they are copied.
+				 * a record too big for the read goes in pieces, the
+				 * next read picks up where this one stopped.
+				 */
+				if((m = recspan(h, off, count)) > 0)
+					count = m;
+				ringcopy(h, off, r->ofcall.data, count);
+				adv = count;
+			} else
+				/* reply straight from the chunk */
+				r->ofcall.data = ringpin(h, off, &count, &c);
+			if(co != nil){
+				co->off = off;
+				co->want = r->ifcall.count;
+				co->framed = framed;
+				co->count = count;
+				co->adv = adv;
+				co->data = r->ofcall.data;
+				co->c = c;
+				co->lead = c == nil ? r : nil;
+				c = nil;
+			}
+		}
 		r->ofcall.count = count;
-		mq->nxt += count;
-		mq->bufuse += count;
-		h->rwaiting[i] = 0;
-		if((i == h->qrans) && (i < h->qrnum))
-			h->qrans++;
-		respond(r, nil);
+		h->bytesout += count;
+		h->nreads++;
+		if(timing){
+			if(now == 0)
+				now = nsec();
+			if(e->t != 0)
+				hublat(h, Lqueued, now - e->t);
+			stampfirst(h, off + adv, now);
+		}
+		if(off + adv > mq->roff)
+			mq->roff = off + adv;
+		if(framed && (seq = recseq(h, off + adv - 1)) > mq->seqsent)
+			mq->seqsent = seq;
+		if(sched)
+			hubcharge(h, mq, adv);
+		reqdeq(e);
+		if(co == nil || co->lead != r)
+			respond(r, nil);
+		if(c != nil)
+			chunkput(c);
+	}
+	for(i = 0; i < NCOHORT; i++)
+		cohortdone(&cohort[i]);
+	if(now != 0)
+		stamplast(h, now);
+	if(held){
+		h->sheld = 1;
+		armhub(h);
+	}
+}
 
-		if(paranoid){
-			h->ketchup = mq->bufuse;
-			if(mq->bufuse <= h->buckfull)
-				h->tomatoflag = 0;	/* do not wait for us */
-			else
-				h->tomatoflag = 1;
-			qunlock(&h->replk);
+/* let go of a cohort's reply once all its readers have it, answering the one it was copied for */
+void
+cohortdone(Cohort *co)
+{
+	if(co->off < 0)
+		return;
+	if(co->c != nil)
+		chunkput(co->c);
+	if(co->lead != nil)
+		respond(co->lead, nil);
+	co->off = -1;
+	co->c = nil;
+	co->lead = nil;
+}
+
+/* record a latency in one of the hub's histograms */
+void
+hublat(Hub *h, int i, vlong ns)
+{
+	if(h->lat[i] == nil)
+		h->lat[i] = histalloc();
+	histadd(h->lat[i], ns);
+}
+
+/*
+ * when timing, the hub keeps a ring of stored writes with their times.
+ * a stamp is dropped once every reader has read the write, or once the
+ * write is lapped, so the ring holds at most the writes in the buffer.
+ */
+void
+stamppush(Hub *h, vlong off, vlong t)
+{
+	Wstamp *v;
+	int i, n;
+
+	if(h->nstamps == h->nws){
+		n = h->nws ? 2*h->nws : 64;
+		v = emalloc9p(n * sizeof(*v));
+		for(i = 0; i < h->nstamps; i++)
+			v[i] = *stampat(h, i);
+		free(h->ws);
+		h->ws = v;
+		h->nws = n;
+		h->wsfirst = 0;
+	}
+	v = &h->ws[(h->wsfirst + h->nstamps++) & (h->nws-1)];
+	v->off = off;
+	v->t = t;
+}
+
+Wstamp*
+stampat(Hub *h, int i)
+{
+	return &h->ws[(h->wsfirst + i) & (h->nws-1)];
+}
+
+void
+stamptrim(Hub *h)
+{
+	while(h->nstamps > 0 && ((h->nfirst > 0 && h->nlast > 0) || stampat(h, 0)->off < h->tail)){
+		h->wsfirst = (h->wsfirst + 1) & (h->nws-1);
+		h->nstamps--;
+		if(h->nfirst > 0)
+			h->nfirst--;
+		if(h->nlast > 0)
+			h->nlast--;
+	}
+}
+
+/* a reader was sent the stream up to end, writes starting before it have been read */
+void
+stampfirst(Hub *h, vlong end, vlong now)
+{
+	Wstamp *w;
+
+	while(h->nfirst < h->nstamps && (w = stampat(h, h->nfirst))->off < end){
+		hublat(h, Lfirst, now - w->t);
+		h->nfirst++;
+	}
+}
+
+/* writes that end before the slowest reader have been read by all of them */
+void
+stamplast(Hub *h, vlong now)
+{
+	Msgq *mq;
+	vlong min, end;
+	int n;
+
+	n = 0;
+	min = h->woff;
+	for(mq = h->readers; mq != nil; mq = mq->next){
+		if(mq->dead)
+			continue;
+		n++;
+		if(mq->roff < min)
+			min = mq->roff;
+	}
+	while(n > 0 && h->nlast < h->nstamps){
+		end = h->woff;
+		if(h->nlast+1 < h->nstamps)
+			end = stampat(h, h->nlast+1)->off;
+		if(end > min)
+			break;
+		hublat(h, Llast, now - stampat(h, h->nlast)->t);
+		h->nlast++;
+	}
+	stamptrim(h);
+}
+
+/*
+ * in record mode each write is a record and the hub keeps the offsets
+ * where they start in a ring that grows as needed. Starts before the tail
+ * are dropped, so the ring holds only records that are wholly buffered.
+ * Numbered writes are kept in the same ring with their numbers.
+ */
+void
+recpush(Hub *h, vlong off, vlong seq)
+{
+	Rec *v, *e;
+	int i, n;
+
+	if(h->nrecs == h->nrec){
+		n = h->nrec ? 2*h->nrec : 64;
+		v = emalloc9p(n * sizeof(*v));
+		for(i = 0; i < h->nrecs; i++)
+			v[i] = h->rec[(h->rfirst + i) & (h->nrec-1)];
+		free(h->rec);
+		h->rec = v;
+		h->nrec = n;
+		h->rfirst = 0;
+	}
+	e = &h->rec[(h->rfirst + h->nrecs++) & (h->nrec-1)];
+	e->off = off;
+	e->seq = seq;
+}
+
+/*
+ * the next number of one sequence shared by all hubs, so readers of several
+ * hubs can put their writes back in order. The seq file shows it as its length
+ * before any later number is given out, a reader that has seen that number has
+ * every earlier write of the hub.
+ */
+vlong
+newseq(Hub *h)
+{
+	vlong seq;
+
+	lock(&seqlk);
+	seq = ++wseq;
+	h->lastseq = seq;
+	if(h->seqf != nil)
+		filedir(h->seqf)->length = seq;
+	unlock(&seqlk);
+	return seq;
+}
+
+/* the number of the write holding the byte at off, 0 if it was not numbered */
+vlong
+recseq(Hub *h, vlong off)
+{
+	int i;
+
+	if((i = recfind(h, off)) < 0)
+		return 0;
+	return h->rec[(h->rfirst + i) & (h->nrec-1)].seq;
+}
+
+/* a frame header: the write's sequence number and the length of the data, little endian */
+void
+putframe(uchar *p, vlong seq, long len)
+{
+	int j;
+
+	for(j = 0; j < 8; j++)
+		p[j] = seq >> 8*j;
+	for(j = 0; j < 4; j++)
+		p[8+j] = len >> 8*j;
+}
+
+vlong
+recat(Hub *h, int i)
+{
+	return h->rec[(h->rfirst + i) & (h->nrec-1)].off;
+}
+
+/* the newest record starting at or before off, -1 if off is before them all */
+int
+recfind(Hub *h, vlong off)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = h->nrecs;
+	while(lo < hi){
+		mid = (lo + hi) / 2;
+		if(recat(h, mid) <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* the oldest whole record, or the write offset if there is none */
+vlong
+recfirst(Hub *h)
+{
+	if(h->nrecs > 0)
+		return recat(h, 0);
+	return h->woff;
+}
+
+void
+rectrim(Hub *h)
+{
+	while(h->nrecs > 0 && recat(h, 0) < h->tail){
+		h->rfirst = (h->rfirst + 1) & (h->nrec-1);
+		h->nrecs--;
+	}
+}
+
+/* bytes in the whole records from off that fit in count, 0 if not even the first fits */
+long
+recspan(Hub *h, vlong off, long count)
+{
+	int lo, hi, mid;
+	vlong b;
+
+	if(h->woff - off <= count)
+		return h->woff - off;
+	lo = 0;
+	hi = h->nrecs;
+	while(lo < hi){
+		mid = (lo + hi) / 2;
+		if(recat(h, mid) <= off + count)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == 0 || (b = recat(h, lo-1)) <= off)
+		return 0;
+	return b - off;
+}
+
+/*
+ * fill buf with frames of the stream from off, using at most n bytes of buf
+ * and avail bytes of the stream, and set *adv to the stream bytes used. Each
+ * frame is FRAMEHDR bytes of the write's sequence number and the length of the
+ * frame's data, both little endian, then that much of the write. Data written
+ * before the hub was numbered has sequence number 0. A write only goes out in pieces,
+ * each with its number, when it does not fit in a read by itself.
+ */
+long
+framefill(Hub *h, vlong off, char *buf, long n, long avail, vlong *adv)
+{
+	Rec *e;
+	vlong end, seq;
+	long m, tot;
+	int i;
+
+	tot = 0;
+	*adv = 0;
+	i = recfind(h, off);
+	while(avail > 0 && n - tot > FRAMEHDR){
+		seq = 0;
+		end = recfirst(h);
+		if(i >= 0){
+			e = &h->rec[(h->rfirst + i) & (h->nrec-1)];
+			seq = e->seq;
+			end = i+1 < h->nrecs ? recat(h, i+1) : h->woff;
+		}
+		m = end - off;
+		if(m > avail || m > n - tot - FRAMEHDR){
+			if(tot > 0)
+				break;
+			m = avail;
+			if(m > n - FRAMEHDR)
+				m = n - FRAMEHDR;
 		}
+		putframe((uchar*)buf + tot, seq, m);
+		ringcopy(h, off, buf + tot + FRAMEHDR, m);
+		tot += FRAMEHDR + m;
+		off += m;
+		avail -= m;
+		*adv += m;
+		i++;
 	}
+	return tot;
 }
 
-/* wrsend replies to Reqs queued by fswrite */
+/*
+ * wrsend replies to Reqs queued by fswrite.
+ * In paranoid mode a write stays queued until enough readers have room
+ * for it, so the writer is not answered and goes at the pace of its readers.
+ */
 void
 wrsend(Hub *h)
 {
 	Req *r;
 	u32int count;
+	vlong now, due, seq;
+
+	/* take queued 9p write requests for this hub in order */
+	while(!qempty(&h->wq)){
+		r = h->wq.next->r;
+		count = r->ifcall.count;
+		if(count > maxmsglen)
+			count = maxmsglen;
+		if(h->paranoid && !hubroom(h, count))
+			return;
+		if(h->lp != nil && (due = limit(h->lp, count)) != 0){
+			/* over the rate limit, the ticker lets it in when it is due */
+			h->ldue = due;
+			armhub(h);
+			return;
+		}
+		if(timing){
+			now = nsec();
+			if(h->wq.next->t != 0)
+				hublat(h, Lstore, now - h->wq.next->t);
+			stamppush(h, h->woff, now);
+		}
+		reqdeq(h->wq.next);
+
+		/* Move the data into the bucket, update our counters, and respond */
+		seq = 0;
+		if(h->numbered || h->nmuxes > 0)
+			seq = newseq(h);
+		if(h->records || h->numbered)
+			recpush(h, h->woff, seq);
+		hubappend(h, r->ifcall.data, count);
+		if(h->nmuxes > 0)
+			muxappend(h, r->ifcall.data, count, seq);
+		rectrim(h);
+		if(timing)
+			stamptrim(h);
+		hubsetlen(h, r->fid->file);
+		h->bytesin += count;
+		h->nwrites++;
+		r->ofcall.count = count;
+		respond(r, nil);
+	}
+}
+
+/*
+ * A mux is a hub named name.mux in record mode whose data is the writes to
+ * every other hub with a name starting with name, each as one record: a frame
+ * header of its sequence number and length, then the name of the hub it was
+ * written to ending in a zero byte, then the data. A client of many hubs can
+ * then keep a single read waiting on the mux. Membership is by name, so it is
+ * worked out again whenever a hub or a mux is made, with reglk write locked.
+ * Muxes are hashed by their name less .mux, so a new hub only looks up the
+ * prefixes of its name; only a new mux goes through all the hubs.
+ * The member's lock is held when a write is passed on, then the mux's.
+ */
+int
+ismuxof(Hub *m, Hub *h)
+{
+	return m->ismux && !h->ismux && !isctl(h) && strncmp(h->name, m->name, strlen(m->name) - 4) == 0;
+}
+
+/* join a new hub to its muxes, or a new mux to its members */
+void
+muxlink(Hub *h)
+{
+	Hub *o, **mp;
+	uint k;
 	int i;
-	int j;
 
-	if(h->qwnum == 0)
+	if(h->ismux){
+		mp = muxchain(h);
+		h->mnext = *mp;
+		*mp = h;
+		for(o = firsthub->next; o != nil; o = o->next)
+			if(ismuxof(h, o))
+				muxjoin(o, h);
 		return;
+	}
+	if(isctl(h))
+		return;
+	/* the hash of each prefix of the name, as muxchain makes it */
+	k = 0;
+	for(i = 0; h->name[i] != '\0'; i++){
+		k = k*31 + (uchar)h->name[i];
+		for(o = muxtab[k & (NMUXHASH-1)]; o != nil; o = o->mnext)
+			if(strlen(o->name) - 4 == i+1 && ismuxof(o, h))
+				muxjoin(h, o);
+	}
+}
 
-	/* in paranoid mode we fork and slack off while the readers catch up */
-	if(paranoid){
-		qlock(&h->wrlk);
-		if((h->ketchup < h->buckfull - MAGIC) || (h->ketchup > h->buckfull)){
-			if(rfork(RFPROC|RFMEM) == 0){
-				sleep(100);
-				h->suicidal = 1;
-				for(j = 0; ((j < 77) && (h->tomatoflag)); j++)
-					sleep(7);		/* Give readers time to catch up */
-			} else
-				return;	/* This branch should become a read request */
+void
+muxjoin(Hub *h, Hub *m)
+{
+	h->muxes = erealloc9p(h->muxes, (h->nmuxes+1) * sizeof(Hub*));
+	h->muxes[h->nmuxes++] = m;
+	m->members = erealloc9p(m->members, (m->nmembers+1) * sizeof(Hub*));
+	m->members[m->nmembers++] = h;
+}
+
+/* a hub about to be freed leaves its muxes, a mux its members */
+void
+muxunlink(Hub *h)
+{
+	Hub **mp;
+	int i;
+
+	for(i = 0; i < h->nmuxes; i++)
+		muxdrop(&h->muxes[i]->members, &h->muxes[i]->nmembers, h);
+	h->nmuxes = 0;
+	for(i = 0; i < h->nmembers; i++)
+		muxdrop(&h->members[i]->muxes, &h->members[i]->nmuxes, h);
+	h->nmembers = 0;
+	if(!h->ismux)
+		return;
+	for(mp = muxchain(h); *mp != nil; mp = &(*mp)->mnext)
+		if(*mp == h){
+			*mp = h->mnext;
+			break;
 		}
+}
+
+/* the hash chain of a mux, by its name less .mux */
+Hub**
+muxchain(Hub *m)
+{
+	uint k;
+	int i, n;
+
+	n = strlen(m->name) - 4;
+	k = 0;
+	for(i = 0; i < n; i++)
+		k = k*31 + (uchar)m->name[i];
+	return &muxtab[k & (NMUXHASH-1)];
+}
+
+/* take h out of a list of muxes or members, order does not matter */
+void
+muxdrop(Hub ***v, int *n, Hub *h)
+{
+	int i;
+
+	for(i = 0; i < *n; i++)
+		if((*v)[i] == h){
+			(*v)[i] = (*v)[--*n];
+			return;
+		}
+}
+
+/* pass a write on to the hub's muxes, they never hold it back */
+void
+muxappend(Hub *h, char *data, long n, vlong seq)
+{
+	Hub *m;
+	uchar hdr[FRAMEHDR];
+	long nl;
+	int i;
+
+	nl = strlen(h->name) + 1;
+	putframe(hdr, seq, nl + n);
+	for(i = 0; i < h->nmuxes; i++){
+		m = h->muxes[i];
+		qlock(&m->lk);
+		recpush(m, m->woff, seq);
+		ringappend(m, (char*)hdr, FRAMEHDR);
+		ringappend(m, h->name, nl);
+		ringappend(m, data, n);
+		rectrim(m);
+		m->bytesin += FRAMEHDR + nl + n;
+		m->nwrites++;
+		if(!coalesce(m))
+			msgsend(m);
+		qunlock(&m->lk);
 	}
+}
 
-	/* loop through queued 9p write requests for this hub */
-	for(i = h->qwans; i <= h->qwnum; i++){
-		if(! h->wwaiting[i]){
-			if((i == h->qwans) && (i < h->qwnum))
-				h->qwans++;
+/*
+ * check whether count more bytes would leave enough readers unlapped.
+ * readers that have not read for idletime seconds are not waited for.
+ * if the write must wait, the ticker looks again when the next reader
+ * holding it back would become idle.
+ */
+int
+hubroom(Hub *h, long count)
+{
+	Msgq *mq;
+	vlong now, idle, due;
+	int nactive, nroom, need;
+
+	now = nsec();
+	idle = idletime * SECOND;
+	nactive = nroom = 0;
+	due = 0;
+	for(mq = h->readers; mq != nil; mq = mq->next){
+		if(mq->dead || (idle > 0 && now - mq->lastread >= idle))
 			continue;
+		nactive++;
+		if(mq->roff == h->woff || h->woff + count - mq->roff <= h->size)
+			nroom++;
+		else if(idle > 0 && (due == 0 || mq->lastread + idle < due))
+			due = mq->lastread + idle;
+	}
+	need = quorum;
+	if(need == 0 || need > nactive)
+		need = nactive;
+	if(nroom >= need){
+		h->fdue = 0;
+		return 1;
+	}
+	h->fdue = due;
+	if(due != 0)
+		armhub(h);
+	return 0;
+}
+
+/* let held writes through after the paranoid rules were relaxed */
+void
+flowhubs(void)
+{
+	Hub *h;
+
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		if(!qempty(&h->wq)){
+			wrsend(h);
+			msgsend(h);
 		}
-		r = h->qwrites[i];
-		count = r->ifcall.count;
-		if(count > maxmsglen)
-			count = maxmsglen;
+		qunlock(&h->lk);
+	}
+}
+
+void
+qinit(Qent *q)
+{
+	q->next = q;
+	q->prev = q;
+}
+
+int
+qempty(Qent *q)
+{
+	return q->next == q;
+}
+
+/* move every entry of src to the tail of dst */
+void
+qsplice(Qent *dst, Qent *src)
+{
+	if(qempty(src))
+		return;
+	src->next->prev = dst->prev;
+	dst->prev->next = src->next;
+	src->prev->next = dst;
+	dst->prev = src->prev;
+	qinit(src);
+}
+
+/* add a Req to the tail of a hub queue, the entry hangs off the Req aux pointer */
+void
+reqenq(Qent *q, Hub *h, Req *r)
+{
+	Qent *e;
+
+	if(e = h->freeq)
+		h->freeq = e->next;
+	else
+		e = emalloc9p(sizeof(*e));
+	e->r = r;
+	e->h = h;
+	e->t = timing ? nsec() : 0;
+	e->next = q;
+	e->prev = q->prev;
+	q->prev->next = e;
+	q->prev = e;
+	if(r->ifcall.type == Tread)
+		h->nqr++;
+	else
+		h->nqw++;
+	r->aux = e;
+}
+
+/* move an entry to the tail of another queue of the same hub */
+void
+qmove(Qent *q, Qent *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->next = q;
+	e->prev = q->prev;
+	q->prev->next = e;
+	q->prev = e;
+}
+
+/* unlink an entry from whichever queue holds it and return its Req */
+Req*
+reqdeq(Qent *e)
+{
+	Req *r;
+
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	r = e->r;
+	if(r->ifcall.type == Tread)
+		e->h->nqr--;
+	else
+		e->h->nqw--;
+	r->aux = nil;
+	e->next = e->h->freeq;
+	e->h->freeq = e;
+	return r;
+}
+
+/* park a read on the ready list if there is data for it, otherwise on the idle list */
+void
+hubqueue(Hub *h, Req *r)
+{
+	vlong off;
+
+	off = reqoff(h, r);
+	if(off != h->woke){
+		reqenq(&h->ready, h, r);
+		return;
+	}
+	if(off + r->ifcall.count < h->minwant)
+		h->minwant = off + r->ifcall.count;
+	reqenq(&h->idle, h, r);
+}
 
-		/* bucket wraparound check */
-		if((h->buckfull + count) >= bucksize - 16){
-			h->buckwrap = h->inbuckp;
-			h->inbuckp = h->bucket;
-			h->buckfull = 0;
+/* the stream offset a read starts at, position file reads carry it as their 9p offset */
+vlong
+reqoff(Hub *h, Req *r)
+{
+	Msgq *mq;
+
+	if(r->fid->file == h->posf)
+		return r->ifcall.offset;
+	mq = r->fid->aux;
+	return mq->roff;
+}
+
+/* after a write, the hub file holds tail to woff and the position file 0 to woff */
+void
+hubsetlen(Hub *h, File *f)
+{
+	filedir(f)->length = h->woff - h->tail;
+	if(h->posf != nil)
+		filedir(h->posf)->length = h->woff;
+}
+
+/* hubsetlen for a change made outside any request on the hub file, which is looked up */
+void
+hubrelen(Hub *h)
+{
+	File *d, *f;
+
+	d = h->statf != nil ? h->statf->parent : fs.tree->root;
+	if((f = walkfile(d, h->name)) == nil)
+		return;
+	if(f->aux == h)
+		hubsetlen(h, f);
+	closefile(f);
+}
+
+/*
+ * make a side file such as name.pos next to the hub file in dir. The hub
+ * keeps the reference createfile gives us until the hub file is destroyed.
+ */
+File*
+mkside(Hub *h, File *dir, char *uid, char *suffix, ulong perm)
+{
+	File *f;
+	char name[SMBUF+8];
+
+	snprint(name, sizeof(name), "%s.%s", h->name, suffix);
+	if((f = createfile(dir, name, uid, perm, h)) != nil)
+		incref(h);
+	return f;
+}
+
+int
+isside(Hub *h, File *f)
+{
+	return f == h->posf || f == h->statf || f == h->seqf;
+}
+
+/* statistics are lines of a key and a value, reader lines give a fid and its lag */
+char *latname[NLAT] = {
+	[Lstore] = "store",
+	[Lfirst] = "first",
+	[Llast] = "last",
+	[Lqueued] = "queued",
+};
+
+void
+hubstats(Hub *h, Fmt *f)
+{
+	Msgq *mq;
+	int i, n;
+
+	fmtprint(f, "name %s\n", h->name);
+	fmtprint(f, "bytesin %lld\nwrites %lld\n", h->bytesin, h->nwrites);
+	fmtprint(f, "bytesout %lld\nreads %lld\n", h->bytesout, h->nreads);
+	fmtprint(f, "full %lld\nsize %llud\nwraps %lld\n", h->woff - h->tail, h->size, h->woff / (vlong)h->size);
+	fmtprint(f, "zchunks %d\nzbytes %lld\n", h->zchunks, h->zbytes);
+	fmtprint(f, "qreads %d\nqwrites %d\n", h->nqr, h->nqw);
+	fmtprint(f, "overruns %lld\ngapbytes %lld\n", h->overruns, h->gapbytes);
+	fmtprint(f, "shared %lld\n", h->nshared);
+	fmtprint(f, "muxes %d\n", h->nmuxes);
+	fmtprint(f, "limitsleep %lld\n", h->lp ? h->lp->totalsleep : 0);
+	fmtprint(f, "weight %d\ncap %lld\n", h->weight, h->cap);
+	fmtprint(f, "paranoid %d\nfrozen %d\ntrunc %d\n", h->paranoid, h->frozen, h->trunc);
+	fmtprint(f, "limit %lld %lld %lld\n", h->lp ? h->bp : 0, h->lp ? h->st : 0, h->lp ? h->rt : 0);
+	n = 0;
+	for(mq = h->readers; mq != nil; mq = mq->next)
+		if(!mq->dead)
+			n++;
+	fmtprint(f, "readers %d\n", n);
+	for(mq = h->readers; mq != nil; mq = mq->next)
+		if(!mq->dead)
+			fmtprint(f, "reader %lud %lld\n", mq->myfid, h->woff - mq->roff);
+	for(i = 0; i < NLAT; i++)
+		histprint(f, latname[i], h->lat[i]);
+}
+
+/* the stats file sums the counters of every hub */
+void
+allstats(Fmt *f)
+{
+	Hub *h;
+	vlong bin, nw, bout, nr, full, over, gap, slept, zb, sh;
+	int n, qr, qw, zc;
+
+	bin = nw = bout = nr = full = over = gap = slept = zb = sh = 0;
+	n = qr = qw = zc = 0;
+	rlock(&reglk);
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		n++;
+		bin += h->bytesin;
+		nw += h->nwrites;
+		bout += h->bytesout;
+		nr += h->nreads;
+		full += h->woff - h->tail;
+		zc += h->zchunks;
+		zb += h->zbytes;
+		qr += h->nqr;
+		qw += h->nqw;
+		over += h->overruns;
+		gap += h->gapbytes;
+		sh += h->nshared;
+		if(h->lp)
+			slept += h->lp->totalsleep;
+		qunlock(&h->lk);
+	}
+	runlock(&reglk);
+	fmtprint(f, "hubs %d\n", n);
+	fmtprint(f, "bytesin %lld\nwrites %lld\n", bin, nw);
+	fmtprint(f, "bytesout %lld\nreads %lld\n", bout, nr);
+	fmtprint(f, "full %lld\n", full);
+	fmtprint(f, "zchunks %d\nzbytes %lld\n", zc, zb);
+	fmtprint(f, "qreads %d\nqwrites %d\n", qr, qw);
+	fmtprint(f, "overruns %lld\ngapbytes %lld\n", over, gap);
+	fmtprint(f, "shared %lld\n", sh);
+	fmtprint(f, "limitsleep %lld\n", slept);
+}
+
+/*
+ * decide whether a write should wait for more before waking the readers.
+ * writes are held until the hub's window has passed since the first of them
+ * or cbytes have piled up, unless some queued read can already be filled.
+ */
+int
+coalesce(Hub *h)
+{
+	vlong now;
+
+	if(h->cwindow == 0 || qempty(&h->idle))
+		return 0;
+	if(h->minwant <= h->woff)
+		return 0;
+	if(h->cbytes > 0 && h->woff - h->woke >= h->cbytes)
+		return 0;
+	now = nsec();
+	if(h->cdue == 0){
+		h->cdue = now + h->cwindow;
+		armhub(h);
+		return 1;
+	}
+	return now < h->cdue;
+}
+
+/* put a hub holding writes on the ticker's list, and see that the ticker wakes when it is due */
+void
+armhub(Hub *h)
+{
+	vlong due;
+
+	due = hubdue(h);
+	qlock(&armlk);
+	if(!h->armed){
+		h->armed = 1;
+		h->aprev = nil;
+		h->anext = armed;
+		if(armed)
+			armed->aprev = h;
+		armed = h;
+	}
+	if(due != 0)
+		alarmfor(due);
+	qunlock(&armlk);
+}
+
+void
+disarmhub(Hub *h)
+{
+	qlock(&armlk);
+	if(h->armed){
+		h->armed = 0;
+		if(h->aprev)
+			h->aprev->anext = h->anext;
+		else
+			armed = h->anext;
+		if(h->anext)
+			h->anext->aprev = h->aprev;
+	}
+	qunlock(&armlk);
+}
+
+/* the earliest time the ticker has something to do for a hub, 0 for never */
+vlong
+hubdue(Hub *h)
+{
+	vlong due, t[5];
+	int i;
+
+	t[0] = h->fdue;
+	t[1] = h->ldue;
+	t[2] = h->cdue;
+	t[3] = h->jdue;
+	t[4] = h->sheld ? nsec() + TICK*1000000LL : 0;
+	due = 0;
+	for(i = 0; i < nelem(t); i++)
+		if(t[i] != 0 && (due == 0 || t[i] < due))
+			due = t[i];
+	return due;
+}
+
+/*
+ * see that an alarm goes off by time due. An alarm already set for then
+ * or sooner will do, the ticker arms the hub again if it is early.
+ * Otherwise an idle alarm proc is given the deadline, or a new one is
+ * started, since a sleeping proc cannot be told to wake sooner.
+ * Called with armlk held.
+ */
+void
+alarmfor(vlong due)
+{
+	Alarm *a, *idle;
+
+	idle = nil;
+	for(a = alarms; a != nil; a = a->next)
+		if(a->t == 0)
+			idle = a;
+		else if(a->t <= due)
+			return;
+	if((a = idle) == nil){
+		a = emalloc9p(sizeof(*a));
+		a->c = chancreate(sizeof(vlong), 1);
+		a->next = alarms;
+		alarms = a;
+		proccreate(alarmproc, a, STACK);
+	}
+	a->t = due;
+	send(a->c, &due);
+}
+
+void
+alarmproc(void *v)
+{
+	Alarm *a;
+	vlong t, now;
+
+	a = v;
+	for(;;){
+		recv(a->c, &t);
+		if((now = nsec()) < t)
+			sleep((t - now + 999999) / 1000000);
+		qlock(&armlk);
+		a->t = 0;
+		qunlock(&armlk);
+		nbsendul(tickc, 1);
+	}
+}
+
+/*
+ * the ticker wakes the readers of hubs whose held writes are due, lets paranoid writes past idle readers,
+ * lets rate limited writes in and runs the bandwidth scheduling rounds. It runs when an alarm goes off
+ * and looks at every armed hub, arming again those with something still to come. the armed hubs are
+ * copied out first, armlk is not held while waiting for a hub.
+ */
+void
+ticker(void*)
+{
+	Hub *h, **v;
+	int i, n, nv;
+	vlong now;
+
+	v = nil;
+	nv = 0;
+	for(;;){
+		recvul(tickc);
+		/* reglk before armlk, as in the request procs */
+		rlock(&reglk);
+		qlock(&armlk);
+		n = 0;
+		for(h = armed; h != nil; h = h->anext){
+			if(n == nv){
+				nv = nv*2 + 8;
+				v = erealloc9p(v, nv * sizeof(*v));
+			}
+			v[n++] = h;
+		}
+		qunlock(&armlk);
+		now = nsec();
+		schedule(v, n, now);
+		for(i = 0; i < n; i++){
+			h = v[i];
+			qlock(&h->lk);
+			if((h->fdue != 0 && now >= h->fdue) || (h->ldue != 0 && now >= h->ldue)){
+				h->fdue = 0;
+				h->ldue = 0;
+				wrsend(h);
+				msgsend(h);
+			} else if(h->cdue != 0 && now >= h->cdue)
+				msgsend(h);
+			if(h->jdue != 0 && now >= h->jdue){
+				h->jdue = 0;
+				if(h->jp != nil && jflush(h->jp) < 0)
+					jfail(h);
+			}
+			if(h->cdue == 0 && h->fdue == 0 && h->ldue == 0 && h->jdue == 0 && !h->sheld)
+				disarmhub(h);
+			else
+				armhub(h);
+			qunlock(&h->lk);
 		}
+		runlock(&reglk);
+	}
+}
 
-		/* Move the data into the bucket, update our counters, and respond */
-		memmove(h->inbuckp, r->ifcall.data, count);
-		h->inbuckp += count;
-		if(h->inbuckp > h->buckwrap)
-			h->buckwrap=h->inbuckp+1;
-		h->buckfull += count;
-		r->fid->file->length = h->buckfull;
-		r->ofcall.count = count;
-		h->wwaiting[i] = 0;
-		if((i == h->qwans) && (i < h->qwnum))
-			h->qwans++;
-		if(applylimits)
-			limit(h->lp, count);
-		respond(r, nil);
+/*
+ * Bandwidth scheduling is deficit round robin. It applies to a hub when
+ * there is a server budget and the hub was given a weight, or the hub or
+ * one of its readers has a cap. Other hubs answer reads at once.
+ * Replies from such a hub may only spend bytes granted by the ticker, and
+ * reads that find too little wait on the hub's held list until the next
+ * round. Caps are token buckets refilled as time passes.
+ */
+int
+hubsched(Hub *h)
+{
+	vlong b;
+
+	lock(&budlk);
+	b = budget;
+	unlock(&budlk);
+	return (b > 0 && h->shared) || h->cap > 0 || h->ncaps > 0;
+}
 
-		if(paranoid){
-			if(h->wrlk.locked == 1)
-				qunlock(&h->wrlk);
-			/* If suicidal we forked another flow of control, so exit */
-			if(h->suicidal){
-				h->suicidal = 0;
-				exits(nil);
+/* bytes a reader of a scheduled hub may be sent now */
+vlong
+hubgrant(Hub *h, Msgq *mq)
+{
+	vlong n;
+
+	n = h->deficit;
+	if(mq->deficit < n)
+		n = mq->deficit;
+	if(h->cap > 0 && h->ctok < n)
+		n = h->ctok;
+	if(mq->cap > 0 && mq->ctok < n)
+		n = mq->ctok;
+	return n;
+}
+
+void
+hubcharge(Hub *h, Msgq *mq, vlong n)
+{
+	h->deficit -= n;
+	mq->deficit -= n;
+	if(h->cap > 0)
+		h->ctok -= n;
+	if(mq->cap > 0)
+		mq->ctok -= n;
+}
+
+/* add what rate allows for dt ns to a token bucket holding at most a tenth of a second */
+vlong
+refill(vlong tok, vlong rate, vlong dt)
+{
+	vlong max;
+
+	tok += rate * (dt/1000) / 1000000;
+	max = rate / 10;
+	if(max < QUANTUM)
+		max = QUANTUM;
+	return tok > max ? max : tok;
+}
+
+/*
+ * run scheduling rounds over the armed hubs. Each round grants every hub
+ * with held reads a quantum times its weight out of the budget, and each
+ * of its held readers a quantum times theirs, then lets the hub send.
+ * Rounds go on until the budget is spent or no hub sends any more.
+ * A hub left with nothing held gives back what it did not send.
+ */
+void
+schedule(Hub **v, int n, vlong now)
+{
+	Hub *h;
+	Qent *e;
+	Msgq *mq;
+	vlong dt, q, sent;
+	int i, k, more, spent;
+
+	dt = now - lastround;
+	if(lastround == 0 || dt > SECOND/10)
+		dt = SECOND/10;
+	lastround = now;
+	lock(&budlk);
+	if(budget > 0)
+		btok = refill(btok, budget, dt);
+	unlock(&budlk);
+	for(i = 0; i < n; i++){
+		h = v[i];
+		qlock(&h->lk);
+		if(h->cap > 0)
+			h->ctok = refill(h->ctok, h->cap, dt);
+		if(h->ncaps > 0)
+			for(mq = h->readers; mq != nil; mq = mq->next)
+				if(mq->cap > 0)
+					mq->ctok = refill(mq->ctok, mq->cap, dt);
+		qunlock(&h->lk);
+	}
+	do{
+		more = 0;
+		for(k = 0; k < n; k++){
+			i = (rrnext + k) % n;
+			lock(&budlk);
+			spent = budget > 0 && btok <= 0;
+			unlock(&budlk);
+			if(spent){
+				/* out of budget, the next tick starts with the hub that missed out */
+				rrnext = i;
+				return;
 			}
+			h = v[i];
+			qlock(&h->lk);
+			if(h->sheld){
+				q = QUANTUM * h->weight;
+				if(h->deficit < q){
+					lock(&budlk);
+					if(budget > 0 && q > btok)
+						q = btok;
+					h->deficit += q;
+					if(budget > 0)
+						btok -= q;
+					unlock(&budlk);
+				}
+				for(e = h->held.next; e != &h->held; e = e->next){
+					mq = e->r->fid->aux;
+					if(mq->deficit < QUANTUM * mq->weight)
+						mq->deficit += QUANTUM * mq->weight;
+				}
+				h->sheld = 0;
+				sent = h->bytesout;
+				msgsend(h);
+				if(h->bytesout > sent)
+					more = 1;
+				if(!h->sheld){
+					lock(&budlk);
+					if(budget > 0)
+						btok += h->deficit;
+					unlock(&budlk);
+					h->deficit = 0;
+				}
+			}
+			qunlock(&h->lk);
+		}
+	}while(more);
+	if(n > 0)
+		rrnext = (rrnext + 1) % n;
+}
+
+/*
+ * free any clients and hubs destroyed since the last reap.
+ * the clients go first, a hub is only destroyed after all of its fids.
+ * no hub lock or reglk may be held by the caller.
+ */
+void
+reap(void)
+{
+	Hub *h, *hubs;
+	Msgq *mq, *mqs;
+
+	if(deadmqs == nil && deadhubs == nil)
+		return;
+	if(!canqlock(&reaplk))
+		return;
+	lock(&deadlk);
+	mqs = deadmqs;
+	hubs = deadhubs;
+	deadmqs = nil;
+	deadhubs = nil;
+	unlock(&deadlk);
+	/* freemq may send held writes on to muxes, whose lists reglk guards */
+	rlock(&reglk);
+	while(mq = mqs){
+		mqs = mq->dnext;
+		if(h = mq->h)
+			qlock(&h->lk);
+		freemq(mq);
+		if(h)
+			qunlock(&h->lk);
+	}
+	runlock(&reglk);
+	if(hubs){
+		wlock(&reglk);
+		while(h = hubs){
+			hubs = h->dnext;
+			freehub(h);
 		}
+		wunlock(&reglk);
 	}
+	qunlock(&reaplk);
+}
+
+/* the hub a request works on, for a flush the hub of the request being flushed */
+Hub*
+reqhub(Req *r)
+{
+	if(r->ifcall.type == Tflush)
+		r = r->oldreq;
+	if(r == nil || r->fid == nil || r->fid->file == nil)
+		return nil;
+	return r->fid->file->aux;
+}
+
+int
+isctl(Hub *h)
+{
+	return strncmp(h->name, "ctl", 3) == 0;
 }
 
+/*
+ * lib9p calls in here. With worker procs each hub is always served by the
+ * same worker, so the requests of one hub are still handled in arrival order
+ * while different hubs run in parallel.
+ */
 void
-hubqueue(Hub *h, Req *r)
+dispatch(Req *r)
+{
+	Hub *h;
+
+	h = reqhub(r);
+	if(h != nil && h->wc != nil)
+		sendp(h->wc, r);
+	else
+		serve(r);
+}
+
+void
+worker(void *v)
+{
+	Channel *c;
+
+	c = v;
+	for(;;)
+		serve(recvp(c));
+}
+
+/* run a request with its hub locked, so the ticker never sees a hub half updated */
+void
+serve(Req *r)
 {
-	if(h->qrnum >= MAXQ-2){
-		memmove(h->qreads+1, h->qreads+h->qrans, h->qrnum - h->qrans);
-		memmove(h->rwaiting+1, h->rwaiting+h->qrans, h->qrnum - h->qrans);
-		h->qrnum = h->qrnum - h->qrans + 1;
-		h->qrans = 1;
+	Hub *h;
+	int locked;
+
+	reap();
+	h = reqhub(r);
+	locked = 0;
+	if(h != nil){
+		rlock(&reglk);
+		/* ctl messages lock the hubs they change themselves */
+		if(!isctl(h)){
+			qlock(&h->lk);
+			locked = 1;
+		}
+	}
+	switch(r->ifcall.type){
+	case Topen: fsopen(r); break;
+	case Tcreate: fscreate(r); break;
+	case Tread: fsread(r); break;
+	case Twrite: fswrite(r); break;
+	case Tflush: fsflush(r); break;
+	case Tremove: fsremove(r); break;
+	default: respond(r, Ebad); break;
 	}
-	h->qrnum++;
-	h->rwaiting[h->qrnum] = 1;
-	h->qreads[h->qrnum] = r;
+	if(locked)
+		qunlock(&h->lk);
+	if(h != nil)
+		runlock(&reglk);
 }
 
 /* queue all reads unless Hubs are frozen */
@@ -283,13 +1944,27 @@ fsread(Req *r)
 	char *err;
 	Hub *h;
 	Msgq *mq;
+	Chunk *c;
 	u32int count, n;
 	vlong offset;
-	char tmpstr[2*SMBUF];
+	char tmpstr[2*SMBUF], *s;
+	Fmt fmt;
 
 	h = r->fid->file->aux;
 	err = nil;
-	if(strncmp(h->name, "ctl", 3) == 0){
+	if(h == nil || r->fid->file == h->statf){
+		/* the stats files are made anew for every read */
+		fmtstrinit(&fmt);
+		if(h == nil)
+			allstats(&fmt);
+		else
+			hubstats(h, &fmt);
+		s = fmtstrflush(&fmt);
+		readstr(r, s);
+		free(s);
+		goto done;
+	}
+	if(isctl(h)){
 		if(r->ifcall.offset > 0){
 			r->ofcall.count = 0;
 		done:
@@ -299,8 +1974,15 @@ fsread(Req *r)
 		snprint(tmpstr, sizeof(tmpstr),
 			"\tHubfs %s status (1 is active, 0 is inactive):\n"
 			"Paranoid == %d  Frozen == %d  Trunc == %d  Applylimits == %d\n"
-			"Buffersize == %ulld\n"
-			, srvname, paranoid, frozen, trunc, applylimits, bucksize);
+			"Buffersize == %ulld  Lapgap == %d  Records == %d\n"
+			"Coalesce == %lld usec %ld bytes\n"
+			"Quorum == %d  Idle == %lld sec\n"
+			"Journal == %s  Durability == %s\n"
+			"Timing == %d\n"
+			"Budget == %lld B/s\n"
+			, srvname, paranoid, frozen, trunc, applylimits, bucksize, lapmode == Lapgap, recmode,
+			coalwindow, coalbytes, quorum, idletime,
+			jdir ? jdir : "none", jlevelname(jmode), timing, budget);
 		if((n = strlen(tmpstr)) > r->ifcall.count){
 			err = "read too small for response";
 			goto done;
@@ -310,30 +1992,48 @@ fsread(Req *r)
 		goto done;
 	}
 
-	/* In frozen mode hubs behave as ramdisk files */
-	if(frozen){
-		mq = r->fid->aux;
-		if(mq->bufuse > 0){
+	mq = r->fid->aux;
+	if(r->fid->file == h->posf){
+		/* reads of the position file start where the 9p offset says */
+		if(r->ifcall.offset > h->woff){
+			err = Ebeyond;
+			goto done;
+		}
+	} else if(h->frozen && r->fid->file != h->seqf){
+		/* In frozen mode hubs behave as ramdisk files */
+		if(mq->roff > h->tail){
 			hubqueue(h, r);
 			return;
 		}
 		count = r->ifcall.count;
 		offset = r->ifcall.offset;
-		while(offset >= bucksize)
-			offset -= bucksize;
-		if(offset >= h->buckfull){
+		while(offset >= h->size)
+			offset -= h->size;
+		if(offset >= h->woff - h->tail){
 			r->ofcall.count = 0;
 			goto done;
 		}
-		if((offset + count >= h->buckfull) && (offset < h->buckfull))
-			count = h->buckfull - offset;
-		memmove(r->ofcall.data, h->bucket + offset, count);
+		if(offset + count >= h->woff - h->tail)
+			count = h->woff - h->tail - offset;
+		r->ofcall.data = ringpin(h, h->tail + offset, &count, &c);
 		r->ofcall.count = count;
-		goto done;
+		h->bytesout += count;
+		h->nreads++;
+		respond(r, nil);
+		chunkput(c);
+		return;
 	}
 
+	/* kept up always, so turning on paranoid mode does not find every reader idle */
+	mq->lastread = nsec();
 	hubqueue(h, r);
 	msgsend(h);
+
+	/* the reader may have made room for writes held in paranoid mode */
+	if(h->paranoid && !qempty(&h->wq)){
+		wrsend(h);
+		msgsend(h);
+	}
 }
 
 /* queue writes unless hubs are frozen */
@@ -343,53 +2043,68 @@ fswrite(Req *r)
 	char *err;
 	Hub *h;
 	u32int count;
-	vlong offset;
-	int i, j;
+	vlong offset, full;
+	char *keep;
+	int i;
 
 	h = r->fid->file->aux;
 	err = nil;
-	if(strncmp(h->name, "ctl", 3) == 0){
+	if(isctl(h)){
 		err = hubctl(r->ifcall.data);
 	done:
 		respond(r, err);
 		return;
-	} else if(frozen){
+	} else if(r->fid->file == h->statf){
+		/* reset the latency histograms */
+		if(r->ifcall.count < 5 || strncmp(r->ifcall.data, "reset", 5) != 0){
+			err = Ebadstats;
+			goto done;
+		}
+		for(i = 0; i < NLAT; i++)
+			if(h->lat[i] != nil)
+				histreset(h->lat[i]);
+		r->ofcall.count = r->ifcall.count;
+		goto done;
+	} else if(h->ismux){
+		err = Emuxwrite;
+		goto done;
+	} else if(h->frozen){
+		/* the file is the data from tail to woff, a write replaces everything after offset */
 		count = r->ifcall.count;
 		offset = r->ifcall.offset;
-		while(offset >= bucksize)
-			offset -= bucksize;
-		h->inbuckp = h->bucket +offset;
-		h->buckfull = h->inbuckp - h->bucket;
-		if(h->buckfull + count >= bucksize){
-			h->inbuckp = h->bucket;
-			h->buckfull = 0;
-		}
-		memmove(h->inbuckp, r->ifcall.data, count);
-		h->inbuckp += count;
-		h->buckfull += count;
-		r->fid->file->length = h->buckfull;
+		while(offset >= h->size)
+			offset -= h->size;
+		full = h->woff - h->tail;
+		if(offset != full){
+			/* stream offsets never go back, so the kept bytes are stored again */
+			keep = nil;
+			if(offset > 0){
+				keep = emalloc9p(offset);
+				ringcopy(h, h->tail, keep, offset < full ? offset : full);
+			}
+			hubzap(h);
+			if(keep != nil){
+				hubappend(h, keep, offset);
+				free(keep);
+			}
+		}
+		hubappend(h, r->ifcall.data, count);
+		hubsetlen(h, r->fid->file);
+		h->bytesin += count;
+		h->nwrites++;
 		r->ofcall.count = count;
 		goto done;
 	}
 
 	/* Actual queue logic here */
-	if(h->qwnum >= MAXQ - 2){
-		j = 1;
-		for(i = h->qwans; i <= h->qwnum; i++) {
-			h->qwrites[j] = h->qwrites[i];
-			h->wwaiting[j] = h->wwaiting[i];
-			j++;
-		}
-		h->qwnum = h->qwnum - h->qwans + 1;
-		h->qwans = 1;
-	}
-	h->qwnum++;
-	h->wwaiting[h->qwnum] = 1;
-	h->qwrites[h->qwnum] = r;
+	reqenq(&h->wq, h, r);
 	wrsend(h);
+	if(coalesce(h))
+		return;
 	msgsend(h);
 	/* we do msgsend here after wrsend because we know a write has happened */
 	/* that means there is new data for readers, so send it to them asap */
+	/* unless the hub coalesces small writes, then the ticker sends them later */
 }
 
 /* making a file is making a new hub, prepare it for i/o and add to hublist */
@@ -399,20 +2114,35 @@ fscreate(Req *r)
 	Hub *h;
 	File *f;
 	char *err;
+	int n;
 
 	err = nil;
-	if(nhubs >= MAXHUBS){
-		err = Etoomany;
-	} else if(f = createfile(r->fid->file, r->ifcall.name, r->fid->uid, r->ifcall.perm, nil)){
-		nhubs++;
+	if(f = createfile(r->fid->file, r->ifcall.name, r->fid->uid, r->ifcall.perm, nil)){
 		h = emalloc9p(sizeof(*h));
 		setuphub(h);
-		lasthub->next = h;
-		lasthub = h;
-		strncat(h->name, r->ifcall.name, SMBUF);
+		strecpy(h->name, h->name+sizeof(h->name), r->ifcall.name);
+		n = strlen(h->name);
+		if(n > 4 && strcmp(h->name+n-4, ".mux") == 0){
+			/* a mux keeps its members' writes as records and nothing else */
+			h->ismux = 1;
+			h->records = 1;
+		} else if(jdir != nil && !isctl(h) && (h->jp = jopen(jdir, h->name, 1)) == nil)
+			fprint(2, "hubfs: journal of %s: %r\n", h->name);
+		incref(h);
+		if(h->ismux)
+			h->statf = mkside(h, r->fid->file, r->fid->uid, "stats", 0644);
+		else if(!isctl(h)){
+			h->posf = mkside(h, r->fid->file, r->fid->uid, "pos", 0444);
+			h->statf = mkside(h, r->fid->file, r->fid->uid, "stats", 0644);
+			h->seqf = mkside(h, r->fid->file, r->fid->uid, "seq", 0444);
+		}
+		wlock(&reglk);
+		addhub(h);
+		muxlink(h);
+		wunlock(&reglk);
 		f->aux = h;
 		r->fid->file = f;
-		r->ofcall.qid = f->qid;
+		r->ofcall.qid = filedir(f)->qid;
 	} else
 		err = Ebad;
 
@@ -434,127 +2164,287 @@ fsopen(Req *r)
 	q = emalloc9p(sizeof(*q));
 
 	q->myfid = r->fid->fid;
-	q->nxt = h->bucket;
-	q->bufuse = 0;
-	if(r->ifcall.mode&OTRUNC){
+	q->roff = h->tail;
+	if(r->ifcall.mode&OTRUNC && !isside(h, r->fid->file)){
 		if(allowzap){
-			h->inbuckp = h->bucket;
-			h->buckfull = 0;
-			r->fid->file->length = 0;
+			hubzap(h);
+			filedir(r->fid->file)->length = 0;
 		}
 	}
-	if(trunc){
-		q->nxt = h->inbuckp;
-		q->bufuse = h->buckfull;
+	if(h->trunc)
+		q->roff = h->woff;
+	q->lastread = nsec();
+	q->weight = 1;
+	/* writes are numbered once someone reads them in frames */
+	if(r->fid->file == h->seqf)
+		h->numbered = 1;
+	if((r->ifcall.mode&3) != OWRITE && r->fid->file != h->statf){
+		/* paranoid writers wait on the clients that read */
+		q->h = h;
+		q->next = h->readers;
+		if(h->readers)
+			h->readers->prev = q;
+		h->readers = q;
 	}
 	r->fid->aux = q;
 	respond(r, nil);
 }
 
-/* flush a pending request if the client asks us to */
+/*
+ * flush a pending request if the client asks us to.
+ * lib9p already looked up the old Req by tag in the connection's request pool,
+ * and a queued Req carries its queue entry in aux, so no hub needs scanning.
+ */
 void
 fsflush(Req *r)
 {
-	Hub *h;
-
-	for(h = firsthub->next; h != nil; h = h->next)
-		if(flushinated(h, r))
-			return;
+	Qent *e;
+	Req *tr;
 
+	if(r->oldreq != nil && (e = r->oldreq->aux) != nil){
+		tr = reqdeq(e);
+		tr->ofcall.count = 0;
+		respond(tr, nil);
+	}
 	respond(r, nil);
 }
 
-/* check a hub to see if it contains a pending Req with matching tag */
-int
-flushinated(Hub *h, Req *r)
+/* removing a hub file takes its side files along, lib9p removes the hub file after we respond */
+void
+fsremove(Req *r)
 {
-	Req *tr;
-	int i;
+	Hub *h;
+	File *f;
 
-	for(i = h->qrans; i <= h->qrnum; i++){
-		if(! h->rwaiting[i])
-			continue;
-		tr=h->qreads[i];
-		if(tr->tag == r->ifcall.oldtag){
-			tr->ofcall.count = 0;
-			h->rwaiting[i] = 0;
-			if((i == h->qrans) && (i < h->qrnum))
-				h->qrans++;
-			respond(tr, nil);
-			respond(r, nil);
-			return 1;
-		}
+	f = r->fid->file;
+	if(f == statsfile){
+		respond(r, Estatsrm);
+		return;
 	}
-	for(i = h->qwans; i <= h->qwnum; i++){
-		if(! h->wwaiting[i])
-			continue;
-		tr=h->qwrites[i];
-		if(tr->tag == r->ifcall.oldtag){
-			tr->ofcall.count = 0;
-			h->wwaiting[i] = 0;
-			if((i == h->qwans) && (i < h->qwnum))
-				h->qwans++;
-			respond(tr, nil);
-			respond(r, nil);
-			return 1;
+	if(f != nil && (h = f->aux) != nil){
+		if(isside(h, f)){
+			respond(r, Eposrm);
+			return;
+		}
+		if(h->posf != nil){
+			incref(fileref(h->posf));
+			removefile(h->posf);
+		}
+		if(h->statf != nil){
+			incref(fileref(h->statf));
+			removefile(h->statf);
+		}
+		if(h->seqf != nil){
+			incref(fileref(h->seqf));
+			removefile(h->seqf);
 		}
 	}
-	return 0;
+	respond(r, nil);
 }
 
-/* delete the hub. We don't track the associated mqs of clients so we leak them. */
+/*
+ * a hub file or side file is gone, once all are the hub is deleted.
+ * Its clients' mqs were already given up with their fids.
+ * lib9p can call this from inside respond while the hub is locked, so the hub
+ * is only queued here and freed by the next reap.
+ */
 void
 fsdestroyfile(File *f)
 {
 	Hub *h;
 
-	if(h = f->aux){
-		nhubs--;
-		unlinkhub(h);
-		if(h->lp)
-			free(h->lp);
-		free(h->bucket);
-		free(h);
+	if((h = f->aux) == nil)
+		return;
+	if(!isside(h, f)){
+		if(h->posf != nil)
+			closefile(h->posf);
+		if(h->statf != nil)
+			closefile(h->statf);
+		if(h->seqf != nil)
+			closefile(h->seqf);
+	}
+	if(decref(h) == 0){
+		lock(&deadlk);
+		h->dnext = deadhubs;
+		deadhubs = h;
+		unlock(&deadlk);
 	}
 }
 
-/* called when a hubfile is created */
-/* ?Why is qrans set to 1 and qwans to 0 when both are set to 1 upon looping? */
+/* a client fid is gone, its mq is freed by the next reap like dead hubs */
 void
-setuphub(Hub *h)
+fsdestroyfid(Fid *f)
+{
+	Msgq *mq;
+
+	if(mq = f->aux){
+		mq->dead = 1;
+		lock(&deadlk);
+		mq->dnext = deadmqs;
+		deadmqs = mq;
+		unlock(&deadlk);
+	}
+}
+
+/* a departing reader may have been holding back paranoid writes */
+void
+freemq(Msgq *mq)
 {
-	h->bucket = emalloc9p(bucksize);
-	h->inbuckp = h->bucket;
-	h->qrnum = 0;
-	h->qrans = 1;
-	h->qwnum = 0;
-	h->qwans = 0;
-	h->ketchup = 0;
-	h->buckfull = 0;
-	h->buckwrap = h->inbuckp + bucksize;
-	if(applylimits){
-		h->bp = bytespersecond;
-		h->st = separationinterval;
-		h->rt = resettime;
-		h->lp = startlimit(SECOND/h->bp, h->st, h->rt * SECOND);
+	Hub *h;
+
+	if(h = mq->h){
+		if(mq->prev)
+			mq->prev->next = mq->next;
+		else
+			h->readers = mq->next;
+		if(mq->next)
+			mq->next->prev = mq->prev;
+		if(mq->cap > 0)
+			h->ncaps--;
+		if(h->paranoid && !qempty(&h->wq)){
+			wrsend(h);
+			msgsend(h);
+		}
+	}
+	free(mq);
+}
+
+void
+freehub(Hub *h)
+{
+	Qent *e;
+	int i;
+
+	unlinkhub(h);
+	muxunlink(h);
+	disarmhub(h);
+	if(h->jp != nil){
+		jremove(h->jp);
+		h->jp = nil;
+	}
+	while(e = h->freeq){
+		h->freeq = e->next;
+		free(e);
 	}
+	if(h->lp)
+		free(h->lp);
+	ringfree(h);
+	free(h->rec);
+	free(h->muxes);
+	free(h->members);
+	free(h->ws);
+	for(i = 0; i < NLAT; i++)
+		free(h->lat[i]);
+	free(h);
+}
+
+/* called when a hubfile is created, the request queues start out empty */
+void
+setuphub(Hub *h)
+{
+	ringinit(h, bucksize);
+	ringcompress(h, comphot);
+	h->lapmode = lapmode;
+	h->paranoid = paranoid;
+	h->frozen = frozen;
+	h->trunc = trunc;
+	h->records = recmode;
+	h->cwindow = coalwindow * 1000;
+	h->cbytes = coalbytes;
+	h->minwant = MAXOFF;
+	qinit(&h->ready);
+	qinit(&h->idle);
+	qinit(&h->wq);
+	qinit(&h->held);
+	h->weight = hubweight;
+	h->shared = hubshared;
+	h->cap = hubcap;
+	if(applylimits)
+		hublimit(h, bytespersecond, separationinterval, resettime);
 }
 
-/* remove a hub about to be deleted from the linked list of hubs */
+/* set the rate limits of a hub, with no bytes per second or interval it is not limited */
 void
-unlinkhub(Hub *th)
+hublimit(Hub *h, vlong bp, vlong st, vlong rt)
+{
+	h->bp = bp;
+	h->st = st;
+	h->rt = rt;
+	free(h->lp);
+	h->lp = nil;
+	h->ldue = 0;
+	if(bp > 0 || st > 0)
+		h->lp = startlimit(bp > 0 ? SECOND/bp : 0, st, rt * SECOND);
+}
+
+uint
+hashname(char *s)
 {
-	Hub *h, *lh;
+	uint h;
 
-	lh = nil;
-	h = firsthub;
-	while(h != nil && h != th){
-		lh = h;
-		h = h->next;
+	h = 0;
+	while(*s != '\0')
+		h = h*31 + (uchar)*s++;
+	return h;
+}
+
+/* double the hash table once chains would average more than two hubs */
+void
+growhubtab(void)
+{
+	Hub **tab, *h, *nh;
+	int i, n;
+
+	n = nhubtab*2;
+	tab = emalloc9p(n * sizeof(*tab));
+	for(i = 0; i < nhubtab; i++){
+		for(h = hubtab[i]; h != nil; h = nh){
+			nh = h->hnext;
+			h->hnext = tab[hashname(h->name) & (n-1)];
+			tab[hashname(h->name) & (n-1)] = h;
+		}
 	}
+	free(hubtab);
+	hubtab = tab;
+	nhubtab = n;
+}
+
+/* add a new hub to the end of the list of hubs and to the name table */
+void
+addhub(Hub *h)
+{
+	Hub **hp;
+
+	if(++nhubs > 2*nhubtab)
+		growhubtab();
+	h->prev = lasthub;
+	lasthub->next = h;
+	lasthub = h;
+	hp = &hubtab[hashname(h->name) & (nhubtab-1)];
+	h->hnext = *hp;
+	*hp = h;
+	if(nworkers > 0)
+		h->wc = workc[hashname(h->name) % nworkers];
+}
 
-	if(h == th)
-		lh->next = h->next;
+/* remove a hub about to be deleted from the list of hubs and the name table */
+void
+unlinkhub(Hub *h)
+{
+	Hub **hp;
+
+	nhubs--;
+	h->prev->next = h->next;
+	if(h->next)
+		h->next->prev = h->prev;
+	else
+		lasthub = h->prev;
+	for(hp = &hubtab[hashname(h->name) & (nhubtab-1)]; *hp != nil; hp = &(*hp)->hnext){
+		if(*hp == h){
+			*hp = h->hnext;
+			break;
+		}
+	}
 }
 
 enum{
@@ -565,6 +2455,22 @@ enum{
 	Trunc,
 	Notrunc,
 	Eof,
+	Skip,
+	Gap,
+	Coalesce,
+	Journ,
+	Record,
+	Norecord,
+	Timing,
+	Notiming,
+	Quorum,
+	Idle,
+	Weight,
+	Cap,
+	Budget,
+	Size,
+	Compress,
+	Limit,
 	Quit,
 	NCmd,
 };
@@ -578,6 +2484,22 @@ char *cmdstr[] = {
 	[Trunc] = "trunc",
 	[Notrunc] = "notrunc",
 	[Eof] = "eof",
+	[Skip] = "skip",
+	[Gap] = "gap",
+	[Coalesce] = "coalesce",
+	[Journ] = "journal",
+	[Record] = "record",
+	[Norecord] = "norecord",
+	[Timing] = "timing",
+	[Notiming] = "notiming",
+	[Quorum] = "quorum",
+	[Idle] = "idle",
+	[Weight] = "weight",
+	[Cap] = "cap",
+	[Budget] = "budget",
+	[Size] = "size",
+	[Compress] = "compress",
+	[Limit] = "limit",
 	[NCmd] = nil,
 };
 
@@ -620,14 +2542,49 @@ hubctl(char *buf)
 	} else
 		p = nil;
 	switch(cmd){
-	case Fear: paranoid = 1; break;
-	case Calm: paranoid = 0; break;
-	case Freeze: frozen = 1; break;
-	case Melt: frozen = 0; break;
-	case Trunc: trunc = 1; break;
-	case Notrunc: trunc = 0; break;
-	case Quit: exits("");
+	case Fear:
+	case Calm:
+	case Freeze:
+	case Melt:
+	case Trunc:
+	case Notrunc:
+		return modehub(p, cmd);
+	case Size: return sizehub(p);
+	case Compress: return comphub(p);
+	case Limit: return limithub(p);
+	case Quit:
+		jsyncall();
+		threadexitsall("");
+	case Journ:
+		if(p == nil || (cmd = jlevel(p)) < 0)
+			return Ebadctl;
+		jmode = cmd;
+		break;
 	case Eof: return eofhub(p);
+	case Skip: return laphub(p, Lapskip);
+	case Gap: return laphub(p, Lapgap);
+	case Coalesce: return coalhub(p);
+	case Record: return rechub(p, 1);
+	case Norecord: return rechub(p, 0);
+	case Weight: return sharehub(p, Weight);
+	case Cap: return sharehub(p, Cap);
+	case Budget: return budgethub(p);
+	case Timing: return timehub(1);
+	case Notiming: return timehub(0);
+	case Quorum:
+		if(p == nil || (quorum = atoi(p)) < 0){
+			quorum = 0;
+			return Ebadctl;
+		}
+		flowhubs();
+		break;
+	case Idle:
+		if(p == nil || (idletime = strtoll(p, nil, 10)) < 0){
+			idletime = 0;
+			return Ebadctl;
+		}
+		flowhubs();
+		break;
 	default:
 		return Ebadctl;
 	}
@@ -643,29 +2600,395 @@ eofhub(char *s){
 
 	fprint(2, "eof: %s\n", s);
 	err = nil;
-	endoffile = 1;
-	for(h = firsthub; h != nil; h = h->next){
-		if(s != nil){
-			if(strcmp(s, h->name) == 0){
+	if(s != nil){
+		if(h = findhub(s))
+			hubeof(h);
+		else
+			err = Enohub;
+	} else
+		for(h = firsthub->next; h != nil; h = h->next)
+			hubeof(h);
+	return err;
+}
+
+void
+hubeof(Hub *h)
+{
+	qlock(&h->lk);
+	h->eof = 1;
+	msgsend(h);
+	h->eof = 0;
+	qunlock(&h->lk);
+}
+
+/* choose skip or gap handling of lapped readers for a named hub, or all of them */
+char*
+laphub(char *s, int mode)
+{
+	Hub *h;
+
+	if(s != nil){
+		if((h = findhub(s)) == nil)
+			return Enohub;
+		h->lapmode = mode;
+		return nil;
+	}
+	lapmode = mode;
+	for(h = firsthub->next; h != nil; h = h->next)
+		h->lapmode = mode;
+	return nil;
+}
+
+/*
+ * turn record mode on or off for a named hub, or all of them.
+ * only writes made in record mode are indexed, older data reads as one record.
+ */
+char*
+rechub(char *s, int on)
+{
+	Hub *h;
+
+	if(s != nil && (h = findhub(s)) == nil)
+		return Enohub;
+	if(s == nil){
+		recmode = on;
+		h = firsthub->next;
+	}
+	for(; h != nil; h = h->next){
+		qlock(&h->lk);
+		/* reads of a mux always end on whole records */
+		h->records = on || h->ismux;
+		if(!h->records && !h->numbered)
+			h->nrecs = 0;
+		qunlock(&h->lk);
+		if(s != nil)
+			break;
+	}
+	return nil;
+}
+
+/* start or stop recording latencies, the write stamps are dropped so timing starts afresh */
+char*
+timehub(int on)
+{
+	Hub *h;
+
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		h->nstamps = h->nfirst = h->nlast = 0;
+		qunlock(&h->lk);
+	}
+	timing = on;
+	return nil;
+}
+
+/* set the coalescing window in microseconds and byte limit of a named hub or all of them */
+char*
+coalhub(char *s)
+{
+	Hub *h;
+	char *f[4];
+	int n;
+	vlong us;
+	long bytes;
+
+	if(s == nil || (n = tokenize(s, f, nelem(f))) < 1 || n > 3)
+		return Ebadctl;
+	us = strtoll(f[0], nil, 10);
+	bytes = 0;
+	if(n > 1)
+		bytes = strtol(f[1], nil, 10);
+	if(us < 0 || bytes < 0)
+		return Ebadctl;
+	if(n == 3){
+		if((h = findhub(f[2])) == nil)
+			return Enohub;
+		qlock(&h->lk);
+		h->cwindow = us * 1000;
+		h->cbytes = bytes;
+		qunlock(&h->lk);
+		return nil;
+	}
+	coalwindow = us;
+	coalbytes = bytes;
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		h->cwindow = us * 1000;
+		h->cbytes = bytes;
+		qunlock(&h->lk);
+	}
+	return nil;
+}
+
+/* set a mode of a named hub, or of all hubs and the default for new ones */
+char*
+modehub(char *s, int cmd)
+{
+	Hub *h;
+
+	if(s != nil){
+		if((h = findhub(s)) == nil)
+			return Enohub;
+		qlock(&h->lk);
+		hubmode(h, cmd);
+		qunlock(&h->lk);
+		return nil;
+	}
+	switch(cmd){
+	case Fear: paranoid = 1; break;
+	case Calm: paranoid = 0; break;
+	case Freeze: frozen = 1; break;
+	case Melt: frozen = 0; break;
+	case Trunc: trunc = 1; break;
+	case Notrunc: trunc = 0; break;
+	}
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		hubmode(h, cmd);
+		qunlock(&h->lk);
+	}
+	return nil;
+}
+
+void
+hubmode(Hub *h, int cmd)
+{
+	switch(cmd){
+	case Fear: h->paranoid = 1; break;
+	case Calm:
+		h->paranoid = 0;
+		/* writes held for readers go through */
+		if(!qempty(&h->wq)){
+			wrsend(h);
+			msgsend(h);
+		}
+		break;
+	case Freeze: h->frozen = 1; break;
+	case Melt: h->frozen = 0; break;
+	case Trunc: h->trunc = 1; break;
+	case Notrunc: h->trunc = 0; break;
+	}
+}
+
+/* resize the buffer of a named hub, or of all hubs and the default for new ones */
+char*
+sizehub(char *s)
+{
+	Hub *h;
+	char *f[3];
+	int n;
+	uvlong size;
+
+	if(s == nil || (n = tokenize(s, f, nelem(f))) < 1 || n > 2)
+		return Ebadctl;
+	if((size = strtoull(f[0], nil, 10)) == 0)
+		return Ebadctl;
+	if(n == 2){
+		if((h = findhub(f[1])) == nil)
+			return Enohub;
+	} else {
+		bucksize = size;
+		h = firsthub->next;
+	}
+	for(; h != nil; h = h->next){
+		qlock(&h->lk);
+		ringresize(h, size);
+		rectrim(h);
+		if(timing)
+			stamptrim(h);
+		if(h->jp != nil)
+			jtrim(h->jp, h->tail);
+		hubrelen(h);
+		qunlock(&h->lk);
+		if(n == 2)
+			break;
+	}
+	return nil;
+}
+
+/* compress the scrollback of a named hub, or of all hubs and new ones, beyond its newest bytes */
+char*
+comphub(char *s)
+{
+	Hub *h;
+	char *f[3];
+	int n;
+	uvlong hot;
+
+	if(s == nil || (n = tokenize(s, f, nelem(f))) < 1 || n > 2)
+		return Ebadctl;
+	hot = strtoull(f[0], nil, 10);
+	if(n == 2){
+		if((h = findhub(f[1])) == nil)
+			return Enohub;
+		qlock(&h->lk);
+		ringcompress(h, hot);
+		qunlock(&h->lk);
+		return nil;
+	}
+	comphot = hot;
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		ringcompress(h, hot);
+		qunlock(&h->lk);
+	}
+	return nil;
+}
+
+/* set the rate limits of a named hub, or of all hubs and the default for new ones */
+char*
+limithub(char *s)
+{
+	Hub *h;
+	char *f[5];
+	int n;
+	vlong bp, st, rt;
+
+	if(s == nil || (n = tokenize(s, f, nelem(f))) < 3 || n > 4)
+		return Ebadctl;
+	bp = strtoll(f[0], nil, 10);
+	st = strtoll(f[1], nil, 10);
+	rt = strtoll(f[2], nil, 10);
+	if(bp < 0 || st < 0 || rt < 0)
+		return Ebadctl;
+	if(n == 4){
+		if((h = findhub(f[3])) == nil)
+			return Enohub;
+	} else {
+		applylimits = bp > 0 || st > 0;
+		bytespersecond = bp;
+		separationinterval = st;
+		resettime = rt;
+		h = firsthub->next;
+	}
+	for(; h != nil; h = h->next){
+		qlock(&h->lk);
+		hublimit(h, bp, st, rt);
+		/* writes held by the old limits are looked at again */
+		if(!qempty(&h->wq)){
+			wrsend(h);
+			msgsend(h);
+		}
+		qunlock(&h->lk);
+		if(n == 4)
+			break;
+	}
+	return nil;
+}
+
+/* set the weight or cap of a named hub, of one of its readers, or of all hubs */
+char*
+sharehub(char *s, int cmd)
+{
+	Hub *h;
+	Msgq *mq;
+	char *f[4];
+	int n;
+	vlong v;
+	ulong fid;
+
+	if(s == nil || (n = tokenize(s, f, nelem(f))) < 1 || n > 3)
+		return Ebadctl;
+	v = strtoll(f[0], nil, 10);
+	if(v < 0 || (cmd == Weight && v < 1))
+		return Ebadctl;
+	if(n == 1){
+		if(cmd == Weight){
+			hubweight = v;
+			hubshared = 1;
+		} else
+			hubcap = v;
+		for(h = firsthub->next; h != nil; h = h->next){
+			qlock(&h->lk);
+			if(cmd == Weight){
+				h->weight = v;
+				h->shared = 1;
+			} else
+				h->cap = v;
+			if(!qempty(&h->held))
 				msgsend(h);
-				break;
-			}
+			qunlock(&h->lk);
+		}
+		return nil;
+	}
+	if((h = findhub(f[1])) == nil)
+		return Enohub;
+	qlock(&h->lk);
+	if(n == 2){
+		if(cmd == Weight){
+			h->weight = v;
+			h->shared = 1;
 		} else
+			h->cap = v;
+	} else {
+		fid = strtoul(f[2], nil, 10);
+		for(mq = h->readers; mq != nil; mq = mq->next)
+			if(mq->myfid == fid && !mq->dead)
+				break;
+		if(mq == nil){
+			qunlock(&h->lk);
+			return Enoclient;
+		}
+		if(cmd == Weight){
+			mq->weight = v;
+			h->shared = 1;
+		} else {
+			if(mq->cap == 0 && v > 0)
+				h->ncaps++;
+			else if(mq->cap > 0 && v == 0)
+				h->ncaps--;
+			mq->cap = v;
+		}
+	}
+	/* held reads go out at once if the hub is no longer scheduled */
+	if(!qempty(&h->held))
+		msgsend(h);
+	qunlock(&h->lk);
+	return nil;
+}
+
+/* set the bytes per second all hubs together may send */
+char*
+budgethub(char *s)
+{
+	Hub *h;
+	vlong v;
+
+	if(s == nil || (v = strtoll(s, nil, 10)) < 0)
+		return Ebadctl;
+	lock(&budlk);
+	budget = v;
+	btok = 0;
+	unlock(&budlk);
+	for(h = firsthub->next; h != nil; h = h->next){
+		qlock(&h->lk);
+		if(!qempty(&h->held))
 			msgsend(h);
+		qunlock(&h->lk);
 	}
-	if(h == nil && s != nil)
-		err = "hub not found";
+	return nil;
+}
 
-	endoffile = 0;
-	return err;
+/* locate a hub by name */
+Hub*
+findhub(char *s)
+{
+	Hub *h;
+
+	for(h = hubtab[hashname(s) & (nhubtab-1)]; h != nil; h = h->hnext)
+		if(strcmp(s, h->name) == 0)
+			return h;
+	return nil;
 }
 
 void
 usage(void)
 {
 	fprint(2,
-		"usage: %s [-Dtz] [-q bktsize] [-b B/s]"
+		"usage: %s [-DRTfgtz] [-p nprocs] [-q bktsize] [-b B/s]"
 		" [-i nsmsg] [-r timerreset] [-l maxmsglen]"
+		" [-w usec] [-W bytes] [-Z hotbytes] [-n quorum] [-e idlesec]"
+		" [-j journaldir] [-J none|periodic|sync]"
 		" [-s srvname] [-m mtpt]\n"
 		, argv0);
 	exits("usage");
@@ -702,9 +3025,9 @@ estrtoull(char *as, char **aas, int base)
 }
 
 void
-main(int argc, char **argv)
+threadmain(int argc, char **argv)
 {
-	int fd;
+	int fd, i;
 	char *addr;
 	char *mtpt;
 	char *p;
@@ -714,6 +3037,9 @@ main(int argc, char **argv)
 	resettime =  60;
 	maxmsglen = 666666;
 	bucksize = 777777;
+	idletime = 10;
+	hubweight = 1;
+	jmode = Jperiodic;
 
 	fs.tree = alloctree(nil, nil, DMDIR|0777, fsdestroyfile);
 
@@ -762,6 +3088,49 @@ main(int argc, char **argv)
 	case 'z':
 		allowzap = 1;
 		break;
+	case 'g':
+		lapmode = Lapgap;
+		break;
+	case 'R':
+		recmode = 1;
+		break;
+	case 'T':
+		timing = 1;
+		break;
+	case 'w':
+		p = EARGF(usage());
+		coalwindow = estrtoull(p, 0, 10);
+		break;
+	case 'W':
+		p = EARGF(usage());
+		coalbytes = estrtol(p, 0, 10);
+		break;
+	case 'Z':
+		p = EARGF(usage());
+		comphot = estrtoull(p, 0, 10);
+		break;
+	case 'f':
+		paranoid = 1;
+		break;
+	case 'n':
+		p = EARGF(usage());
+		quorum = estrtol(p, 0, 10);
+		break;
+	case 'e':
+		p = EARGF(usage());
+		idletime = estrtoull(p, 0, 10);
+		break;
+	case 'p':
+		p = EARGF(usage());
+		nworkers = estrtol(p, 0, 10);
+		break;
+	case 'j':
+		jdir = EARGF(usage());
+		break;
+	case 'J':
+		if((jmode = jlevel(EARGF(usage()))) < 0)
+			usage();
+		break;
 	default:
 		usage();
 	}ARGEND;
@@ -775,6 +3144,9 @@ main(int argc, char **argv)
 	/* start with an allocated but empty Hub */
 	firsthub = emalloc9p(sizeof(*firsthub));
 	lasthub = firsthub;
+	nhubtab = NHASH;
+	hubtab = emalloc9p(nhubtab * sizeof(*hubtab));
+	tickc = chancreate(sizeof(ulong), 1);
 
 	close(0);
 	if((fd = open("/dev/null", ORDWR)) != 0)
@@ -782,11 +3154,24 @@ main(int argc, char **argv)
 	if((fd = dup(0, 1)) != 1)
 		sysfatal("dup returned %d: %r", fd);
 
+	proccreate(ticker, nil, STACK);
+	if(nworkers > 0){
+		workc = emalloc9p(nworkers * sizeof(*workc));
+		for(i = 0; i < nworkers; i++){
+			workc[i] = chancreate(sizeof(Req*), NWORKQ);
+			proccreate(worker, workc[i], STACK);
+		}
+	}
+	if((statsfile = createfile(fs.tree->root, "stats", getuser(), 0444, nil)) == nil)
+		sysfatal("create stats: %r");
+	closefile(statsfile);
+	if(jdir != nil)
+		recoverhubs();
 	if(addr)
-		listensrv(&fs, addr);
+		threadlistensrv(&fs, addr);
 	if(srvname || mtpt)
-		postmountsrv(&fs, srvname, mtpt, MREPL|MCREATE);
-	exits(0);
+		threadpostmountsrv(&fs, srvname, mtpt, MREPL|MCREATE);
+	threadexits(0);
 }
 
 /* basic 9pfile implementation taken from /sys/src/lib9p/ramfs.c */
@@ -803,42 +3188,24 @@ intended mode of operation is for shells, and in this case data is
 both 'bursty' and usually fairly small.  */
 
 /* Paranoid mode is intended as "safe mode" and changes this
-first-come first served behavior.  In paranoid mode, the readers and
-writers attempt to synchronize.  The hub ketchup and tomatoflag
-variables are used to monitor if readers have 'fallen behind' the
-current data pointer, and if so, the writer is qlocked and sleeps
-while we fork off a new flow of control.  We need to do more than just
-answer the queued reads - because we are inside the 9p library (we are
-the functions called by its srv pointer) we want the 9p library to
-actually answer the incoming reads so we have read messages queued to
-answer.  Just clearing out the read message queue isn't enough to
-prioritize readers - we need to fork off so the controlling 9p library
-has a chance to answer NEW reads.  By forking and sleeping the writer,
-we allow the os to answer a new read request, which will unlock the
-writer, which then needs to die at the end of its function because we
-are a single-threaded 9p server and need to maintain one master flow
-of control.  */
-
-/* The paranoid/safe mode code is still limited in its logic for
-handling multiple readers.  The ketchup and tomatoflag are per hub,
-and a hub can have multiple clients.  It is intentional that these
-multiple clients will 'race for the flag' and the writer will stop
-waiting when one reader catches up enough to set ketchup and tomato
-flag.  A more comprehensive solution would require adding new
-structure to the client mq and a ref-counting implementation for
-attaches to the hub so the hub could check the status of each client
-individually.  There are additional problems with this because clients
-are free to 'stop reading' at any time and thus a single client
-unattaching will end up forcing the hub into 'as slow as possible'
-mode.  */
-
-/* To avoid completely freezing a hub, there is still a default "go
-ahead" time even when clients have not caught up.  This time is
-difficult to assess literally because it is a repeated sleep loop so
-the os may perform many activities during the sleep.  Extending the
-length of this delay time increases the safety guarantee for lagging
-clients, but also increases the potential for lag and for
-molasses-like shells after remote clients disconnect.  */
+first-come first served behavior.  Every client that opens a hub for
+reading is kept on the hub's list of readers along with its stream
+offset and the time of its latest read.  A write is only stored when
+it would not lap the readers, so it waits in the hub's write queue
+without a reply, and the writing client blocks as it would on a pipe.
+Each read that takes data, each reader that leaves, and each change
+to the paranoid settings looks at the waiting writes again, so a bulk
+transfer moves at the speed of its consumers.  Nothing sleeps or forks
+inside the 9p service loop.  */
+
+/* By default every reader must have room.  With a quorum of N only N
+of the readers need room, so a few slow readers can lag and be lapped
+without holding back the rest.  Clients are free to 'stop reading' at
+any time, so a reader that has not read for the idle time is no
+longer waited for, and the ticker lets the writes through when that
+time runs out.  An idle reader that reads again is counted again.  A
+reader that was lapped while it was idle gets the usual gap or skip
+behavior.  */
 
 /* In general for the standard use of interactive shells paranoid mode
 is unnecessary and all of this can and should be ignored.  For data
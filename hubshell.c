@@ -1,12 +1,17 @@
 #include <u.h>
 #include <libc.h>
 #include <ctype.h>
+#include <thread.h>
 
 /* hubshell is the client for hubfs, usually started by the hub wrapper script */
 /* it handles attaching and detaching from hub-connected rcs and creating new ones */
 
 enum {
 	SMBUF = 512,
+	BUFSIZE = 8192,				/* Bytes moved by one read */
+	NBUF = 2,					/* Bufs of each input, so one can be read while another is written */
+	STACK = 8192,				/* Stack size of the reader threads */
+	FRAMEHDR = 12,				/* Sequence number and length before each frame from a seq file */
 };
 
 void
@@ -90,20 +95,51 @@ getcmd(char *s)
 }
 
 typedef struct Shell Shell;
-
-/* A Shell opens fds of 3 hubfiles and bucket-brigades data between the hubfs and std i/o fds*/
+typedef struct Src Src;
+typedef struct Buf Buf;
+
+/*
+ * A Shell holds the fds of its 3 hubfiles. One event loop moves the data between
+ * them and the std i/o fds, fed by a reader thread for each input which does its
+ * blocking reads in an ioproc. Moving to another shell only re-points the readers.
+ * Output is read from the hubs' seq files, whose frames carry the number of each
+ * write, so stdout and stderr can be put back in the order they were written.
+ */
 struct Shell {
 	int fd[3];
 	long fddelay[3];
 	char basename[SMBUF];
 	char *fdname[3];
-	char shellctl;
-	QLock;
-	int ref;
+	vlong seen[3];				/* highest write number read from the hubs of fds 1 and 2 */
+	int ref;					/* the event loop while active, and readers still reading it */
+};
+
+/* one input of the event loop, fd 0 is read from the user and 1 and 2 from the active shell */
+struct Src {
+	int fd;
+	Ioproc *io;					/* does the blocking reads */
+	Channel *freec;				/* Bufs the reader may fill */
+	Channel *wakec;				/* the active shell changed */
+	Shell *gaveup;				/* shell whose hub could not be read, not tried again */
+	Buf *pend;					/* Bufs read and not yet written out, oldest first */
+	Buf *pendtail;
+};
+
+/* data read by a Src, passed to the event loop and back */
+struct Buf {
+	Src *src;
+	Shell *s;					/* shell active when a hub read started, nil for fd 0 */
+	long n;						/* bytes read, 0 at eof, -1 on error */
+	long rp;					/* frames before this were written out */
+	Buf *next;					/* next pending Buf of the same Src */
+	char err[ERRMAX];
+	char data[BUFSIZE+1];
 };
 
 Shell *activeshell;
-int cpid;
+Src srcs[3];
+Channel *inc;					/* filled Bufs for the event loop */
+int mainpid;
 int notereceived;
 
 /* string storage for names of hubs and paths */
@@ -120,13 +156,21 @@ int fortunate;
 int echoes;
 
 Shell* setupshell(char*);
-void startshell(Shell*);
-void fdread(int, Shell*);
-void fdinput(int, Shell*);
+void startsrcs(Shell*);
+void srcread(void*);
+void eventloop(void);
+void fdread(Buf*);
+void fdmerge(int);
+vlong nextseq(Src*);
+vlong frameseq(uchar*);
+int caughtup(Src*);
+void release(Buf*);
+void fdinput(Buf*);
+void switchshell(Shell*);
+void stopsrcs(void);
 int touch(char*);
 void freeshell(Shell*);
 int parsebuf(Shell*, char*, int);
-void killfamily(void);
 
 void*
 emalloc(ulong sz)
@@ -141,15 +185,6 @@ emalloc(ulong sz)
 	return v;
 }
 
-int
-erfork(int flags)
-{
-	int n;
-	if((n = rfork(flags)) < 0)
-		sysfatal("erfork: %r");
-	return n;
-}
-
 /* set shellgroup variables and open file descriptors */
 Shell*
 setupshell(char *name)
@@ -158,11 +193,12 @@ setupshell(char *name)
 	int i;
 
 	s = emalloc(sizeof(*s));
+	s->ref = 1;
 	for(i=0; i<3; i++)
 		s->fd[i] = -1;
 	snprint(s->basename, sizeof(s->basename), "%s/%s", mtpt, name);
 	for(i = 1; i < 3; i++){
-		if((s->fdname[i] = smprint("%s%d", s->basename, i)) == nil)
+		if((s->fdname[i] = smprint("%s%d.seq", s->basename, i)) == nil)
 			sysfatal("smprint: %r");
 		if((s->fd[i] = open(s->fdname[i], OREAD)) < 0){
 		err:
@@ -184,96 +220,284 @@ setupshell(char *name)
 	return s;
 }
 
+/* make the shell active and start a reader for each input */
 void
-freeactiveshell(void)
+startsrcs(Shell *s)
 {
-	freeshell(activeshell);
+	Src *src;
+	int i, j;
+
+	activeshell = s;
+	inc = chancreate(sizeof(Buf*), 3*NBUF);
+	for(i = 0; i < 3; i++){
+		src = &srcs[i];
+		src->fd = i;
+		src->io = ioproc();
+		src->freec = chancreate(sizeof(Buf*), NBUF);
+		src->wakec = chancreate(sizeof(ulong), 1);
+		for(j = 0; j < NBUF; j++)
+			sendp(src->freec, emalloc(sizeof(Buf)));
+		threadcreate(srcread, src, STACK);
+	}
 }
 
+/*
+ * read an input into free Bufs and pass them to the event loop. Hub reads
+ * are from whichever shell is active when the read starts; an interrupted
+ * read of a shell no longer active comes back and the next one is from
+ * the new shell. A hub that fails is left alone until the shell changes.
+ */
 void
-startshell(Shell *s)
+srcread(void *v)
 {
-	if(cpid != -1)
-		killfamily();
+	Src *src;
+	Buf *b;
+	Shell *s;
+	int fd;
 
-	activeshell = s;
+	src = v;
+	threadsetname("srcread %d", src->fd);
+	for(;;){
+		while(src->fd != 0 && activeshell == src->gaveup)
+			recvul(src->wakec);
+		b = recvp(src->freec);
+		s = nil;
+		fd = 0;
+		if(src->fd != 0){
+			s = activeshell;
+			s->ref++;
+			fd = s->fd[src->fd];
+		}
+		b->src = src;
+		b->s = s;
+		b->err[0] = '\0';
+		if((b->n = ioread(src->io, fd, b->data, BUFSIZE)) < 0)
+			rerrstr(b->err, sizeof(b->err));
+		else if(activeshell->fddelay[src->fd] >= 0)
+			iosleep(src->io, activeshell->fddelay[src->fd]);
+		if(s != nil && s == activeshell && b->n <= 0 && strstr(b->err, "interrupt") == nil)
+			src->gaveup = s;
+		sendp(inc, b);
+		if(src->fd == 0 && b->n < 0 && notereceived == 0)
+			return;
+	}
+}
 
-	if(cpid = erfork(RFPROC|RFMEM|RFNOTEG|RFNOWAIT)){
-		atexit(freeactiveshell);
-		fdinput(0, s);
-	} else if(erfork(RFPROC|RFMEM|RFNOWAIT)){
-		atexit(freeactiveshell);
-		fdread(1, s);
-	} else{
-		atexit(freeactiveshell);
-		fdread(2, s);
+/*
+ * the one loop that writes everything read to where it goes. All Bufs already
+ * read are taken before any output is written, so the frames read from both
+ * hubs meanwhile can be merged in write order.
+ */
+void
+eventloop(void)
+{
+	Buf *b;
+
+	for(;;){
+		b = recvp(inc);
+		do{
+			if(b->src->fd == 0){
+				fdinput(b);
+				release(b);
+			} else
+				fdread(b);
+		}while((b = nbrecvp(inc)) != nil);
+		fdmerge(1);
 	}
+}
 
-	exits(nil);
+/* hand a Buf back to its reader */
+void
+release(Buf *b)
+{
+	if(b->s != nil)
+		freeshell(b->s);
+	sendp(b->src->freec, b);
 }
 
+/* hub output of the active shell waits to be merged, the rest is dropped */
 void
-fdread(int fd, Shell *s)
+fdread(Buf *b)
 {
-	char buf[8192+1];
-	long n;
+	Shell *s;
+	Src *src;
+	uchar *p;
+	vlong seq;
+	long len;
+	int fd;
 
-	s->ref++;
-	while((n=read(s->fd[fd], buf, sizeof(buf)-1)) > 0){
-		buf[n] = '\0';
-		if(s->fddelay[fd] >= 0)
-			sleep(s->fddelay[fd]);
-		if(write(fd, buf, n) != n){
-			warn("error writing to %s on fd[%d]: %r", s->fdname[fd], s->fd[fd]);
-			return;
+	s = b->s;
+	src = b->src;
+	fd = src->fd;
+	/* frames dropped from a shell no longer active still count as read from its hub */
+	p = (uchar*)b->data;
+	while(s != activeshell && (uchar*)b->data + b->n - p >= FRAMEHDR){
+		if((seq = frameseq(p)) > s->seen[fd])
+			s->seen[fd] = seq;
+		if((len = p[8] | p[9]<<8 | p[10]<<16 | p[11]<<24) < 0)
+			break;
+		p += FRAMEHDR + len;
+	}
+	if(b->n <= 0 || s != activeshell){
+		if(b->n < 0 && s == activeshell && strstr(b->err, "interrupt") == nil)
+			warn("error reading from %s on fd[%d]: %s", s->fdname[fd], s->fd[fd], b->err);
+		release(b);
+		return;
+	}
+	b->rp = 0;
+	b->next = nil;
+	if(src->pend == nil)
+		src->pend = b;
+	else
+		src->pendtail->next = b;
+	src->pendtail = b;
+}
+
+/* the sequence number of the next frame in a Src's pending Bufs, -1 if none */
+vlong
+nextseq(Src *src)
+{
+	Buf *b;
+
+	if((b = src->pend) == nil)
+		return -1;
+	if(b->n - b->rp < FRAMEHDR)
+		return 0;
+	return frameseq((uchar*)b->data + b->rp);
+}
+
+/* the sequence number in a frame header */
+vlong
+frameseq(uchar *p)
+{
+	vlong seq;
+	int i;
+
+	seq = 0;
+	for(i = 7; i >= 0; i--)
+		seq = seq<<8 | p[i];
+	return seq;
+}
+
+/*
+ * whether the hub of a Src with nothing pending owes no write numbered below
+ * the frames pending from the other one. The length of a seq file is the
+ * number of the hub's newest write, and numbers given out after the stat are
+ * higher than those of any frame already read.
+ */
+int
+caughtup(Src *src)
+{
+	Dir *d;
+	int r;
+
+	if(activeshell == src->gaveup)
+		return 1;
+	if((d = dirfstat(activeshell->fd[src->fd])) == nil)
+		return 1;
+	r = d->length <= activeshell->seen[src->fd];
+	free(d);
+	return r;
+}
+
+/*
+ * write out the pending frames of both hubs, lowest sequence number first.
+ * A frame only waits for the other hub when that one has nothing pending and
+ * may still owe an earlier write; if wait is 0 everything pending goes out.
+ * Frames numbered 0 were written before the hub was numbered and go in the
+ * order read. Empty frames only carry the hub's newest number.
+ */
+void
+fdmerge(int wait)
+{
+	Src *src, *o;
+	Buf *b;
+	uchar *p;
+	vlong seq, oseq;
+	long m, len;
+	int quiet[3];
+
+	quiet[1] = quiet[2] = -1;
+	for(;;){
+		src = &srcs[1];
+		o = &srcs[2];
+		seq = nextseq(src);
+		oseq = nextseq(o);
+		if(seq < 0 || (oseq >= 0 && oseq < seq)){
+			src = &srcs[2];
+			o = &srcs[1];
+			seq = oseq;
+			oseq = nextseq(o);
 		}
-		if(s->shellctl == 'q')
+		if(seq < 0)
 			return;
+		if(wait && seq > 0 && oseq < 0){
+			/* the other hub's pending frames cannot change during the pass, stat it once */
+			if(quiet[o->fd] < 0)
+				quiet[o->fd] = caughtup(o);
+			if(!quiet[o->fd])
+				return;
+		}
+		b = src->pend;
+		p = (uchar*)b->data + b->rp;
+		m = b->n - b->rp;
+		len = -1;
+		if(m >= FRAMEHDR)
+			len = p[8] | p[9]<<8 | p[10]<<16 | p[11]<<24;
+		if(len >= 0 && len <= m - FRAMEHDR){
+			p += FRAMEHDR;
+			b->rp += FRAMEHDR;
+			m = len;
+			if(seq > b->s->seen[src->fd])
+				b->s->seen[src->fd] = seq;
+		}
+		/* otherwise it is not a frame, and what is left is written as it is */
+		if(m > 0 && write(src->fd, p, m) != m)
+			warn("error writing to fd[%d]: %r", src->fd);
+		b->rp += m;
+		if(b->rp == b->n){
+			src->pend = b->next;
+			release(b);
+		}
 	}
-	if(n < 0)
-		warn("error reading from %s on fd[%d]: %r", s->fdname[fd], s->fd[fd]);
 }
 
 /* write user input to hubfile */
 void
-fdinput(int fd, Shell *s)
+fdinput(Buf *b)
 {
-	char buf[8192+1];
-	long n;
-	char ctlbuf[8192];
+	Shell *s;
+	char ctlbuf[SMBUF];
 	int ctlfd;
+	long n;
 
-	s->ref++;
-readloop:
-	while((n=read(fd, buf, sizeof(buf)-1))>0){
-		buf[n] = '\0';
+	s = activeshell;
+	if(b->n > 0){
+		b->data[b->n] = '\0';
 		/* check for user %command */
-		if(buf[0] == '%' && parsebuf(s, buf+1, s->fd[fd]))
-			continue;
-		if(s->fddelay[fd] >= 0)
-			sleep(s->fddelay[fd]);
-		if(write(s->fd[fd], buf, n)!=n)
-			warn("error writing to %s on fd[%d]: %r", s->fdname[fd], s->fd[fd]);
-		if(s->shellctl == 'q')
+		if(b->data[0] == '%' && parsebuf(s, b->data+1, s->fd[0]))
 			return;
+		/* parsebuf may have moved us to another shell */
+		s = activeshell;
+		if(write(s->fd[0], b->data, b->n) != b->n)
+			warn("error writing to %s on fd[%d]: %r", s->fdname[0], s->fd[0]);
+		return;
 	}
 	/* eof input from user, send message to hubfs ctl file */
-	if(n == 0){
+	if(b->n == 0){
 		if((ctlfd = open(ctlname, OWRITE)) < 0){
 			warn("can't open ctl file: %r");
-			goto readloop;
+			return;
 		}
 		snprint(ctlbuf, sizeof(ctlbuf), "eof %s\n", basehub);
 		n = strlen(ctlbuf);
 		if(write(ctlfd, ctlbuf, n) != n)
 			warn("error writing to %s on fd[%d]: %r", ctlname, ctlfd);
 		close(ctlfd);
-	}
-	/* hack to fix infinite loop bug with headless drawterm */
-	if(n < 0 && notereceived == 0)
 		return;
+	}
+	/* the reader gives up on fd 0 after an error not caused by a note */
 	notereceived = 0;
-	goto readloop;		/* Use more gotos, they aren't harmful */
 }
 
 /* for creating new hubfiles */
@@ -290,13 +514,13 @@ touch(char *name)
 	return 0;
 }
 
-/* close fds when a shell moves to new hubfs */
+/* close fds once neither the event loop nor a reader uses the shell */
 void
 freeshell(Shell *s)
 {
 	int i;
 
-	if(--s->ref > 0 || !canqlock(s))
+	if(--s->ref > 0)
 		return;
 	for(i = 0; i < 3; i++){
 		if(s->fd[i] >= 0)
@@ -307,20 +531,44 @@ freeshell(Shell *s)
 	free(s);
 }
 
+/* re-point the hub readers at a new shell, their reads of the old one are interrupted */
+void
+switchshell(Shell *ns)
+{
+	Shell *s;
+	int i;
+
+	/* what was read from the old shell goes out first */
+	fdmerge(0);
+	s = activeshell;
+	activeshell = ns;
+	for(i = 1; i < 3; i++){
+		nbsendul(srcs[i].wakec, 1);
+		iointerrupt(srcs[i].io);
+	}
+	freeshell(s);
+}
+
+/* stop reading before leaving the program by exec */
+void
+stopsrcs(void)
+{
+	int i;
+
+	for(i = 0; i < 3; i++){
+		iointerrupt(srcs[i].io);
+		closeioproc(srcs[i].io);
+	}
+}
+
 void
 endshell(Shell *s, Shell *ns, int fd)
 {
-	s->shellctl = 'q';
+	USED(s);
 	if(fortunate) write(fd, "fortune\n", 8);
 	if(echoes) write(fd, "echo\n", 5);
-
-	/* races everywhere */
-	sleep(100);
-	killfamily();
-	freeshell(s);
-	sleep(100);
 	if(ns)
-		startshell(ns);
+		switchshell(ns);
 }
 
 /* handles %commands */
@@ -356,7 +604,7 @@ parsebuf(Shell *s, char *buf, int ofd)
 	case Detach:	/* %detach closes hubshell fds and exits */
 		warn("detaching");
 		endshell(s, nil, ofd);
-		exits(nil);
+		threadexitsall(nil);
 	case Remote:	/* %remote command makes new shell on hubfs host by sending hub -b command */
 		if(p == nil){
 			warn("remote needs a name parameter to create new hubs");
@@ -371,6 +619,7 @@ parsebuf(Shell *s, char *buf, int ofd)
 			break;
 		}
 		endshell(s, newshell, ofd);
+		break;
 	case Local:	/* %local command makes new shell on local machine by executing the hub command and exiting */
 		if(p == nil){
 			warn("local needs a name parameter to create new hubs");
@@ -378,9 +627,10 @@ parsebuf(Shell *s, char *buf, int ofd)
 		}
 		warn("attaching to %s, new shell %s", srvname, p);
 		endshell(s, nil, ofd);
+		stopsrcs();
 		execl("/bin/hub", "hub", srvname, p, 0);
 		sysfatal("execl: %r");
-	case Attach:	/* %attach name starts new shell and exits the current one */
+	case Attach:	/* %attach name moves the readers to another shell */
 		if(p == nil){
 			warn("attach needs a name parameter to know what hubs to use, try %%list");
 			break;
@@ -392,6 +642,7 @@ parsebuf(Shell *s, char *buf, int ofd)
 			break;
 		}
 		endshell(s, newshell, ofd);
+		break;
 	case Err:	/* %err %in %out LONG set the delay before reading/writing on that fd to LONG milliseconds */
 	case In:
 	case Out:
@@ -461,9 +712,7 @@ parsebuf(Shell *s, char *buf, int ofd)
 			close(ctlfd);
 		} else
 			warn("can't open ctl file: %r");
-		s->shellctl = 'q';
-		freeshell(s);
-		exits(nil);
+		threadexitsall(nil);
 	default:	/* no matching command found, print list of commands as reminder */
 		warn("%% commands: \n\tdetach, remote NAME, local NAME, attach NAME \n\tstatus, list, err TIME, in TIME, out TIME\n\tfortun unfort echoes unecho trunc notrunc eof");
 		return 0;
@@ -472,7 +721,10 @@ parsebuf(Shell *s, char *buf, int ofd)
 	return 1;
 }
 
-/* receive interrupt messages (delete key) and pass them through to attached shells */
+/*
+ * receive interrupt messages (delete key) and pass them through to attached shells.
+ * the ioprocs get the note too, only the main proc passes it on.
+ */
 int
 sendinterrupt(void*, char *notename)
 {
@@ -482,6 +734,8 @@ sendinterrupt(void*, char *notename)
 	if(strcmp(notename, "interrupt") != 0)
 		return 0;
 	notereceived = 1;
+	if(getpid() != mainpid)
+		return 1;
 	snprint(notehub, sizeof(notehub), "%s/%s.note", mtpt, basehub);
 	if((notefd = open(notehub, OWRITE)) < 0){
 		warn("can't open %s", notehub);
@@ -493,16 +747,7 @@ sendinterrupt(void*, char *notename)
 }
 
 void
-killfamily(void)
-{
-	if(cpid != -1){
-		postnote(PNGROUP, cpid, "die");
-		cpid = -1;
-	}
-}
-
-void
-main(int argc, char **argv)
+threadmain(int argc, char **argv)
 {
 	Shell *s;
 	char *p;
@@ -517,7 +762,7 @@ main(int argc, char **argv)
 	case 0: break;
 	default:
 		fprint(2, "usage: %s [srvname [shellname]]\n", argv0);
-		exits("usage");
+		threadexitsall("usage");
 	}
 
 	notereceived = 0;
@@ -538,8 +783,8 @@ main(int argc, char **argv)
 	if((s = setupshell(shellname)) == nil)
 		sysfatal("setupshell() failed, bailing out");
 
-	atnotify(sendinterrupt, 1);
-	cpid = -1;
-	atexit(killfamily);
-	startshell(s);
+	mainpid = getpid();
+	threadnotify(sendinterrupt, 1);
+	startsrcs(s);
+	eventloop();
 }
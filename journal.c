@@ -0,0 +1,360 @@
+#include <u.h>
+#include <libc.h>
+#include "journal.h"
+
+/*
+ * A hub journal is a directory of segment files holding the hub's stream
+ * in order, each named by the stream offset of its first byte. Bytes are
+ * only ever appended, and segments wholly older than the hub's tail are
+ * removed, so the journal holds about one segment more than the hub does.
+ * A tail file records the oldest offset still wanted when the hub drops
+ * data some other way, such as being emptied.
+ * Functions returning int give -1 with the error string set on failure.
+*/
+
+static void*
+jalloc(void *p, ulong n)
+{
+	p = realloc(p, n);
+	if(!p)
+		sysfatal("out of memory");
+	return p;
+}
+
+static void
+jpath(char *buf, int n, Journal *j, vlong base)
+{
+	snprint(buf, n, "%s/%020lld", j->dir, base);
+}
+
+static int
+isseg(char *s)
+{
+	if(*s == '\0')
+		return 0;
+	for(; *s != '\0'; s++)
+		if(*s < '0' || *s > '9')
+			return 0;
+	return 1;
+}
+
+static int
+segcmp(void *a, void *b)
+{
+	vlong x, y;
+
+	x = *(vlong*)a;
+	y = *(vlong*)b;
+	return x < y ? -1 : x > y;
+}
+
+static vlong
+readtail(char *path)
+{
+	char buf[32];
+	int fd;
+	long n;
+
+	if((fd = open(path, OREAD)) < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	if(n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return strtoll(buf, nil, 10);
+}
+
+/* open the journal of hub name under root, creating it if needed; fresh discards old contents */
+Journal*
+jopen(char *root, char *name, int fresh)
+{
+	Journal *j;
+	Dir *d, *ld;
+	char path[1024];
+	int fd, i, n;
+
+	j = jalloc(nil, sizeof(Journal));
+	memset(j, 0, sizeof(Journal));
+	j->fd = -1;
+	j->rfd = -1;
+	j->dir = smprint("%s/%s", root, name);
+	if(j->dir == nil)
+		sysfatal("out of memory");
+	if(access(j->dir, AEXIST) < 0){
+		if((fd = create(j->dir, OREAD, DMDIR|0775)) < 0)
+			goto Err;
+		close(fd);
+	}
+	if((fd = open(j->dir, OREAD)) < 0)
+		goto Err;
+	n = dirreadall(fd, &d);
+	close(fd);
+	for(i = 0; i < n; i++){
+		snprint(path, sizeof(path), "%s/%s", j->dir, d[i].name);
+		if(fresh)
+			remove(path);
+		else if(strcmp(d[i].name, "tail") == 0)
+			j->start = readtail(path);
+		else if(isseg(d[i].name)){
+			j->segs = jalloc(j->segs, (j->nsegs+1) * sizeof(vlong));
+			j->segs[j->nsegs++] = strtoll(d[i].name, nil, 10);
+		}
+	}
+	free(d);
+	if(j->nsegs == 0){
+		j->woff = j->start;
+		return j;
+	}
+
+	/* the stream continues at the end of the newest segment */
+	qsort(j->segs, j->nsegs, sizeof(vlong), segcmp);
+	jpath(path, sizeof(path), j, j->segs[j->nsegs-1]);
+	if((fd = open(path, OWRITE)) < 0)
+		goto Err;
+	if((ld = dirfstat(fd)) == nil){
+		close(fd);
+		goto Err;
+	}
+	j->fd = fd;
+	j->woff = j->segs[j->nsegs-1] + ld->length;
+	free(ld);
+	if(j->start < j->segs[0])
+		j->start = j->segs[0];
+	if(j->start > j->woff)
+		j->start = j->woff;
+	return j;
+
+Err:
+	jclose(j);
+	return nil;
+}
+
+/* start a new segment at woff */
+static int
+newseg(Journal *j)
+{
+	char path[1024];
+	int fd;
+
+	jpath(path, sizeof(path), j, j->woff);
+	if((fd = create(path, OWRITE, 0664)) < 0)
+		return -1;
+	if(j->fd >= 0)
+		close(j->fd);
+	j->fd = fd;
+	j->segs = jalloc(j->segs, (j->nsegs+1) * sizeof(vlong));
+	j->segs[j->nsegs++] = j->woff;
+	return 0;
+}
+
+static int
+jwrite(Journal *j, char *data, long n)
+{
+	vlong len;
+	long m;
+
+	while(n > 0){
+		len = JSEGMENT;
+		if(j->nsegs > 0)
+			len = j->woff - j->segs[j->nsegs-1];
+		if(len >= JSEGMENT || j->fd < 0){
+			if(newseg(j) < 0)
+				return -1;
+			len = 0;
+		}
+		m = JSEGMENT - len;
+		if(m > n)
+			m = n;
+		if(pwrite(j->fd, data, m, len) != m)
+			return -1;
+		j->woff += m;
+		data += m;
+		n -= m;
+	}
+	return 0;
+}
+
+/*
+ * a Plan 9 file server has the bytes once pwrite returns,
+ * a unix kernel only has them in its cache until fsync.
+ */
+static int
+jsync(Journal *j)
+{
+#ifdef PLAN9PORT
+	if(fsync(j->fd) < 0)
+		return -1;
+#else
+	USED(j);
+#endif
+	return 0;
+}
+
+/* add n bytes to the end of the journal, batching them unless level is Jsync */
+int
+jappend(Journal *j, char *data, long n, int level)
+{
+	if(level == Jsync || n >= JBUF){
+		if(jflush(j) < 0 || jwrite(j, data, n) < 0)
+			return -1;
+		if(level == Jsync)
+			return jsync(j);
+		return 0;
+	}
+	if(j->buf == nil)
+		j->buf = jalloc(nil, JBUF);
+	if(j->nbuf + n > JBUF && jflush(j) < 0)
+		return -1;
+	memmove(j->buf + j->nbuf, data, n);
+	j->nbuf += n;
+	return 0;
+}
+
+/* write out the batched bytes */
+int
+jflush(Journal *j)
+{
+	long n;
+
+	if(j->nbuf == 0)
+		return 0;
+	n = j->nbuf;
+	j->nbuf = 0;
+	return jwrite(j, j->buf, n);
+}
+
+/* record that the hub dropped everything before tail */
+int
+jtail(Journal *j, vlong tail)
+{
+	char path[1024];
+	int fd;
+
+	snprint(path, sizeof(path), "%s/tail", j->dir);
+	if((fd = create(path, OWRITE, 0664)) < 0)
+		return -1;
+	if(fprint(fd, "%lld\n", tail) < 0){
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	j->start = tail;
+	jtrim(j, tail);
+	return 0;
+}
+
+/* remove the segments holding nothing at or after tail, the newest is always kept */
+void
+jtrim(Journal *j, vlong tail)
+{
+	char path[1024];
+
+	while(j->nsegs > 1 && j->segs[1] <= tail){
+		jpath(path, sizeof(path), j, j->segs[0]);
+		remove(path);
+		memmove(j->segs, j->segs+1, (j->nsegs-1) * sizeof(vlong));
+		j->nsegs--;
+		if(j->rfd >= 0){
+			close(j->rfd);
+			j->rfd = -1;
+		}
+	}
+}
+
+/* read written bytes starting at stream offset off, for rebuilding a hub */
+long
+jread(Journal *j, vlong off, char *buf, long n)
+{
+	char path[1024];
+	vlong end;
+	long m, got;
+	int i;
+
+	got = 0;
+	while(n > 0 && off < j->woff){
+		i = j->rseg;
+		if(j->rfd < 0 || i >= j->nsegs || j->segs[i] > off || (i+1 < j->nsegs && j->segs[i+1] <= off)){
+			for(i = j->nsegs-1; i > 0 && j->segs[i] > off; i--)
+				;
+			if(j->nsegs == 0 || j->segs[i] > off)
+				break;
+			if(j->rfd >= 0)
+				close(j->rfd);
+			jpath(path, sizeof(path), j, j->segs[i]);
+			if((j->rfd = open(path, OREAD)) < 0)
+				return -1;
+			j->rseg = i;
+		}
+		end = j->woff;
+		if(i+1 < j->nsegs)
+			end = j->segs[i+1];
+		m = n;
+		if(m > end - off)
+			m = end - off;
+		if((m = pread(j->rfd, buf, m, off - j->segs[i])) < 0)
+			return -1;
+		if(m == 0)
+			break;
+		off += m;
+		buf += m;
+		n -= m;
+		got += m;
+	}
+	return got;
+}
+
+static char *jlevels[] = {
+	[Jnone] = "none",
+	[Jperiodic] = "periodic",
+	[Jsync] = "sync",
+};
+
+/* parse a durability level name, -1 if there is none such */
+int
+jlevel(char *s)
+{
+	int i;
+
+	for(i = 0; i < nelem(jlevels); i++)
+		if(strcmp(s, jlevels[i]) == 0)
+			return i;
+	return -1;
+}
+
+char*
+jlevelname(int level)
+{
+	return jlevels[level];
+}
+
+/* let go of the journal without writing out batched bytes */
+void
+jclose(Journal *j)
+{
+	if(j->fd >= 0)
+		close(j->fd);
+	if(j->rfd >= 0)
+		close(j->rfd);
+	free(j->buf);
+	free(j->segs);
+	free(j->dir);
+	free(j);
+}
+
+/* delete the journal along with its hub */
+void
+jremove(Journal *j)
+{
+	char path[1024];
+	int i;
+
+	for(i = 0; i < j->nsegs; i++){
+		jpath(path, sizeof(path), j, j->segs[i]);
+		remove(path);
+	}
+	snprint(path, sizeof(path), "%s/tail", j->dir);
+	remove(path);
+	remove(j->dir);
+	jclose(j);
+}
@@ -0,0 +1,37 @@
+enum{
+	JSEGMENT = 1024*1024,		/* Bytes in a journal segment file */
+	JBUF = 64*1024,				/* Journal bytes batched before they are written */
+	JPERIOD = 1000,				/* Milliseconds batched bytes may wait in periodic mode */
+};
+
+enum{
+	Jnone,						/* batched bytes are written when the batch fills */
+	Jperiodic,					/* and at least every JPERIOD milliseconds */
+	Jsync,						/* every hub write is written before it is answered */
+};
+
+typedef struct Journal Journal; /* On-disk copy of the recent data of a hub */
+
+struct Journal{
+	char *dir;					/* Directory holding the segment files of the hub */
+	vlong *segs;				/* Stream offset of the first byte of each segment, oldest first */
+	int nsegs;
+	int fd;						/* Newest segment, open for writing */
+	int rfd;					/* Segment last read from, -1 if none */
+	int rseg;					/* Index of that segment */
+	vlong start;				/* Oldest stream offset worth recovering */
+	vlong woff;					/* Stream offset just past the bytes written out */
+	char *buf;					/* Batched bytes that follow woff */
+	long nbuf;
+};
+
+Journal* jopen(char *root, char *name, int fresh);
+int jappend(Journal *j, char *data, long n, int level);
+int jflush(Journal *j);
+int jtail(Journal *j, vlong tail);
+void jtrim(Journal *j, vlong tail);
+long jread(Journal *j, vlong off, char *buf, long n);
+int jlevel(char *s);
+char* jlevelname(int level);
+void jclose(Journal *j);
+void jremove(Journal *j);
@@ -0,0 +1,138 @@
+#include <u.h>
+#include <libc.h>
+#include "lz.h"
+
+/*
+ * A byte oriented LZ77 codec in the style of LZ4, fast rather than tight.
+ * Data is a series of sequences, each a token byte holding a literal count
+ * and a match length less LZMIN in its two nibbles, extra count bytes when
+ * a nibble is 15, the literals, then the two byte distance back to the
+ * match and extra length bytes. The last sequence has only literals.
+*/
+
+static uchar*
+putlen(uchar *p, long n)
+{
+	for(; n >= 255; n -= 255)
+		*p++ = 255;
+	*p++ = n;
+	return p;
+}
+
+static ulong
+hash4(uchar *p)
+{
+	ulong v;
+
+	v = p[0] | p[1]<<8 | p[2]<<16 | (ulong)p[3]<<24;
+	return (v * 2654435761UL) >> (32 - LZHASH) & ((1<<LZHASH)-1);
+}
+
+/* compress n bytes into at most max, -1 if they do not fit */
+long
+lzpack(char *src, long n, char *dst, long max)
+{
+	uchar *s, *e, *lit, *p, *q, *d, *de, *tok;
+	ushort tab[1<<LZHASH];
+	long nlit, mlen;
+	ulong h;
+
+	s = (uchar*)src;
+	e = s + n;
+	d = (uchar*)dst;
+	de = d + max;
+	memset(tab, 0, sizeof tab);
+	lit = s;
+	p = s + 1;
+	while(p + LZMIN + 1 < e){
+		h = hash4(p);
+		q = s + tab[h];
+		tab[h] = p - s;
+		if(q >= p || p - q > 0xFFFF || memcmp(p, q, LZMIN) != 0){
+			p++;
+			continue;
+		}
+		for(mlen = LZMIN; p + mlen < e && p[mlen] == q[mlen]; mlen++)
+			;
+		nlit = p - lit;
+		/* worst case room for the token, counts, literals and distance */
+		if(d + 1 + nlit/255 + 1 + nlit + 2 + mlen/255 + 1 > de)
+			return -1;
+		tok = d++;
+		*tok = (nlit < 15 ? nlit : 15) << 4;
+		if(nlit >= 15)
+			d = putlen(d, nlit - 15);
+		memmove(d, lit, nlit);
+		d += nlit;
+		*d++ = p - q;
+		*d++ = (p - q) >> 8;
+		*tok |= mlen - LZMIN < 15 ? mlen - LZMIN : 15;
+		if(mlen - LZMIN >= 15)
+			d = putlen(d, mlen - LZMIN - 15);
+		p += mlen;
+		lit = p;
+	}
+	nlit = e - lit;
+	if(d + 1 + nlit/255 + 1 + nlit > de)
+		return -1;
+	tok = d++;
+	*tok = (nlit < 15 ? nlit : 15) << 4;
+	if(nlit >= 15)
+		d = putlen(d, nlit - 15);
+	memmove(d, lit, nlit);
+	d += nlit;
+	return d - (uchar*)dst;
+}
+
+static uchar*
+getlen(uchar *p, uchar *e, long *n)
+{
+	while(p < e){
+		*n += *p;
+		if(*p++ != 255)
+			return p;
+	}
+	return nil;
+}
+
+/* decompress n bytes into at most max, returning the length or -1 if the data is bad */
+long
+lzunpack(char *src, long n, char *dst, long max)
+{
+	uchar *s, *e, *d, *de, *q;
+	long nlit, mlen, dist;
+	int tok;
+
+	s = (uchar*)src;
+	e = s + n;
+	d = (uchar*)dst;
+	de = d + max;
+	while(s < e){
+		tok = *s++;
+		nlit = tok >> 4;
+		if(nlit == 15 && (s = getlen(s, e, &nlit)) == nil)
+			return -1;
+		if(nlit > e - s || nlit > de - d)
+			return -1;
+		memmove(d, s, nlit);
+		d += nlit;
+		s += nlit;
+		if(s == e)
+			break;
+		if(e - s < 2)
+			return -1;
+		dist = s[0] | s[1]<<8;
+		s += 2;
+		mlen = tok & 15;
+		if(mlen == 15 && (s = getlen(s, e, &mlen)) == nil)
+			return -1;
+		mlen += LZMIN;
+		q = d - dist;
+		if(dist == 0 || q < (uchar*)dst || mlen > de - d)
+			return -1;
+		/* the match may overlap what it writes, so copy forwards a byte at a time */
+		while(mlen-- > 0)
+			*d++ = *q++;
+	}
+	return d - (uchar*)dst;
+}
@@ -0,0 +1,7 @@
+enum{
+	LZMIN = 4,					/* Shortest match worth encoding */
+	LZHASH = 12,				/* Bits of the match finder's hash table */
+};
+
+long lzpack(char *src, long n, char *dst, long max);
+long lzunpack(char *src, long n, char *dst, long max);
@@ -24,40 +24,45 @@ startlimit(vlong nsperbyte, vlong nsmingap, vlong nstoreset)
 	limiter->lastt = 0;
 	limiter->curt = 0;
 	limiter->totalbytes = 0;
+	limiter->totalsleep = 0;
+	limiter->heldt = 0;
 	return limiter;
 }
 
-/* limit is called whenever a write happens */
-void
+/*
+ * limit is called before a write is stored. It counts the write and returns 0
+ * if it may go ahead now, otherwise it returns the time in ns when it may,
+ * and the caller holds the write until then and asks again.
+ */
+vlong
 limit(Limiter *lp, vlong bytes)
 {
+	vlong due;
+
 	lp->curt = nsec();
-	lp->totalbytes += bytes;
 	/* initialize timers if this is the first message written to a hub */
-	if(lp->startt == 0){
-		lp->startt = lp->curt;
-		lp->lastt = lp->curt;
-		return;
-	}
-	/* check if the message has arrived before the minimum interval */
-	if(lp->curt - lp->lastt < lp->sept){
-		lp->sleept = (lp->sept - (lp->curt - lp->lastt)) / 1000000;
-		sleep(lp->sleept);
-		lp->lastt = nsec();
-		return;
-	}
-	/* reset timer if the interval between messages is sufficient */
-	if(lp->curt - lp->lastt > lp->resett){
+	/* and reset them if the interval between messages is sufficient */
+	if(lp->startt == 0 || lp->curt - lp->lastt > lp->resett){
 		lp->startt = lp->curt;
 		lp->lastt = lp->curt;
 		lp->totalbytes = bytes;
-		return;
+		return 0;
 	}
-	/* check the required elapsed time vs actual elapsed time */
-	lp->difft = (lp->nspb * lp->totalbytes) - (lp->curt - lp->startt);
-	if(lp->difft > 1000000){
-		lp->sleept = lp->difft / 1000000;
-		sleep(lp->sleept);
+	/* the message must wait out the minimum interval and the bytes sent before it */
+	due = lp->lastt + lp->sept;
+	lp->difft = lp->startt + lp->nspb * lp->totalbytes;
+	if(lp->difft > due)
+		due = lp->difft;
+	if(due - lp->curt > 1000000){
+		if(lp->heldt == 0)
+			lp->heldt = lp->curt;
+		return due;
 	}
-	lp->lastt = nsec();
+	if(lp->heldt != 0){
+		lp->totalsleep += (lp->curt - lp->heldt) / 1000000;
+		lp->heldt = 0;
+	}
+	lp->totalbytes += bytes;
+	lp->lastt = lp->curt;
+	return 0;
 }
@@ -10,9 +10,10 @@ struct Limiter{
 	vlong lastt;				/* Timestamp of previous message */
 	vlong resett;				/* Time after which to reset limit statistics */
 	vlong totalbytes;			/* Total bytes written since start time */
-	vlong difft;				/* Checks required minimum vs. actual data timing */
-	ulong sleept;				/* Milliseconds of sleep time needed to throttle */
+	vlong difft;				/* Time the bytes written so far allow the next message */
+	vlong heldt;				/* Time the waiting message was first held back, 0 if none */
+	vlong totalsleep;			/* Milliseconds messages were held back in all, for statistics */
 };
 
 Limiter* startlimit(vlong nsperbyte, vlong nsmingap, vlong nstoreset);
-void limit(Limiter *lp, vlong bytes);
+vlong limit(Limiter *lp, vlong bytes);
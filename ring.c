@@ -0,0 +1,338 @@
+#include <u.h>
+#include <libc.h>
+#include <thread.h>			/* for Ref under plan9port */
+#include "ring.h"
+#include "lz.h"
+
+/*
+ * A ring holds the newest size bytes of an endless stream. Positions are
+ * 64 bit stream offsets that only ever grow, and the byte at offset off
+ * lives in chunk slot (off/CHUNK) % nchunks, so a reader that was lapped
+ * is found by comparing its offset with the tail. Chunks are refcounted
+ * so replies can point into them while writers move on; a chunk still
+ * pinned when its slot is reused is left to the reply and replaced.
+ * Optionally, chunks older than the newest few are compressed as they
+ * fill, and unpacked again for the readers that reach back to them.
+ * The caller does all locking.
+*/
+
+static void*
+ralloc(ulong n)
+{
+	void *p;
+
+	p = malloc(n);
+	if(!p)
+		sysfatal("out of memory");
+	return p;
+}
+
+/* the size of a chunk without its data, all a compressed chunk needs */
+#define CHUNKHDR	((char*)((Chunk*)0)->data - (char*)0)
+
+static Chunk*
+newchunk(void)
+{
+	Chunk *c;
+
+	/* only the header needs clearing, the data is written before it is read */
+	c = ralloc(sizeof(Chunk));
+	memset(c, 0, CHUNKHDR);
+	incref(c);
+	return c;
+}
+
+/* give up the chunk in a slot */
+static void
+slotput(Ring *r, Chunk **cp)
+{
+	if((*cp)->z != nil){
+		r->zchunks--;
+		r->zbytes -= (*cp)->nz;
+	}
+	chunkput(*cp);
+	*cp = nil;
+}
+
+/*
+ * compress the chunk in a slot if nothing else points into it and it shrinks by an eighth.
+ * returns 0 if a reply still points into it, so it should be tried again later.
+ */
+static int
+zpack(Ring *r, Chunk **cp)
+{
+	Chunk *c, *nc;
+	long nz;
+
+	c = *cp;
+	if(c->z != nil)
+		return 1;
+	if(c->ref > 1)
+		return 0;
+	if(r->zbuf == nil)
+		r->zbuf = ralloc(CHUNK);
+	r->zbase = -1;
+	if((nz = lzpack(c->data, CHUNK, r->zbuf, CHUNK - CHUNK/8)) < 0)
+		return 1;
+	nc = ralloc(CHUNKHDR);
+	memset(nc, 0, CHUNKHDR);
+	incref(nc);
+	nc->base = c->base;
+	nc->z = ralloc(nz);
+	nc->nz = nz;
+	memmove(nc->z, r->zbuf, nz);
+	*cp = nc;
+	chunkput(c);
+	r->zchunks++;
+	r->zbytes += nz;
+	return 1;
+}
+
+/* compress the chunk starting at base if it is still in the ring, 0 if it is pinned */
+static int
+zseal(Ring *r, vlong base)
+{
+	Chunk **cp;
+
+	if(base < 0)
+		return 1;
+	cp = &r->chunks[(base / CHUNK) % r->nchunks];
+	if(*cp != nil && (*cp)->base == base)
+		return zpack(r, cp);
+	return 1;
+}
+
+/* compress the chunks gone cold, trying again the ones replies were pinning last time */
+static void
+zcool(Ring *r)
+{
+	vlong base, cold, pend;
+
+	cold = (r->woff / CHUNK - r->zhot) * CHUNK;
+	base = cold;
+	if(r->zpend >= 0 && r->zpend < cold){
+		base = r->zpend;
+		if(base < (r->tail / CHUNK) * CHUNK)
+			base = (r->tail / CHUNK) * CHUNK;
+	}
+	pend = -1;
+	for(; base <= cold; base += CHUNK)
+		if(!zseal(r, base) && pend < 0)
+			pend = base;
+	r->zpend = pend;
+}
+
+/* the uncompressed data of a chunk, unpacked into zbuf if need be */
+static char*
+zdata(Ring *r, Chunk *c)
+{
+	if(c->z == nil)
+		return c->data;
+	if(r->zbase != c->base){
+		if(r->zbuf == nil)
+			r->zbuf = ralloc(CHUNK);
+		if(lzunpack(c->z, c->nz, r->zbuf, CHUNK) != CHUNK)
+			sysfatal("ring: bad compressed chunk at %lld", c->base);
+		r->zbase = c->base;
+	}
+	return r->zbuf;
+}
+
+void
+ringinit(Ring *r, uvlong size)
+{
+	r->size = size;
+	r->nchunks = (size + CHUNK-1) / CHUNK + 1;
+	r->chunks = ralloc(r->nchunks * sizeof(Chunk*));
+	memset(r->chunks, 0, r->nchunks * sizeof(Chunk*));
+	r->woff = 0;
+	r->tail = 0;
+	r->zhot = 0;
+	r->zpend = -1;
+	r->zchunks = 0;
+	r->zbytes = 0;
+	r->zbuf = nil;
+	r->zbase = -1;
+}
+
+void
+ringfree(Ring *r)
+{
+	ringtrunc(r, r->woff);
+	free(r->chunks);
+	free(r->zbuf);
+	r->chunks = nil;
+	r->zbuf = nil;
+}
+
+/* change the size of the ring, keeping the newest bytes that still fit */
+void
+ringresize(Ring *r, uvlong size)
+{
+	Ring n;
+	vlong off;
+	long m;
+	char *p;
+
+	ringinit(&n, size);
+	n.zhot = r->zhot;
+	off = r->tail;
+	if(r->woff - off > size)
+		off = r->woff - size;
+	n.woff = n.tail = off;
+	while(off < r->woff){
+		m = CHUNK;
+		if(m > r->woff - off)
+			m = r->woff - off;
+		p = ringspace(&n, &m);
+		ringcopy(r, off, p, m);
+		ringcommit(&n, m);
+		off += m;
+	}
+	ringfree(r);
+	*r = n;
+}
+
+/*
+ * compress all but the newest hot bytes, counting the chunk being written,
+ * and go on compressing chunks as they fill. no hot bytes stops compressing,
+ * the chunks already compressed stay so.
+ */
+void
+ringcompress(Ring *r, uvlong hot)
+{
+	r->zhot = 0;
+	r->zpend = -1;
+	if(hot == 0)
+		return;
+	r->zhot = hot / CHUNK + 1;
+	r->zpend = (r->tail / CHUNK) * CHUNK;
+	zcool(r);
+}
+
+/*
+ * room for up to *n bytes at the write offset, allocating or reusing its chunk.
+ * *n is cut down so the room does not cross the end of the chunk.
+ */
+char*
+ringspace(Ring *r, long *n)
+{
+	Chunk **cp;
+	vlong base;
+	long o;
+
+	o = r->woff % CHUNK;
+	base = r->woff - o;
+	cp = &r->chunks[(r->woff / CHUNK) % r->nchunks];
+	if(*cp != nil && (*cp)->base != base && ((*cp)->ref > 1 || (*cp)->z != nil)){
+		/* a reply still points into the old data, leave it to them */
+		slotput(r, cp);
+	}
+	if(*cp == nil)
+		*cp = newchunk();
+	(*cp)->base = base;
+	if(*n > CHUNK - o)
+		*n = CHUNK - o;
+	return (*cp)->data + o;
+}
+
+/* n bytes were put in the room from ringspace, dropping the oldest if the ring is full */
+void
+ringcommit(Ring *r, long n)
+{
+	r->woff += n;
+	if(r->woff - r->tail > r->size)
+		r->tail = r->woff - r->size;
+	if(r->zhot > 0 && (r->woff - n) / CHUNK != r->woff / CHUNK)
+		zcool(r);
+}
+
+void
+ringappend(Ring *r, char *data, long n)
+{
+	char *p;
+	long m;
+
+	while(n > 0){
+		m = n;
+		p = ringspace(r, &m);
+		memmove(p, data, m);
+		ringcommit(r, m);
+		data += m;
+		n -= m;
+	}
+}
+
+/* copy n bytes starting at stream offset off, which must lie between tail and woff */
+void
+ringcopy(Ring *r, vlong off, char *buf, long n)
+{
+	Chunk *c;
+	long m, o;
+
+	while(n > 0){
+		c = r->chunks[(off / CHUNK) % r->nchunks];
+		o = off % CHUNK;
+		m = CHUNK - o;
+		if(m > n)
+			m = n;
+		memmove(buf, zdata(r, c) + o, m);
+		off += m;
+		buf += m;
+		n -= m;
+	}
+}
+
+/*
+ * find the data at stream offset off for a reply without copying it.
+ * count is cut down so the data does not cross the end of its chunk,
+ * and the chunk is pinned until the reply is sent and chunkput is called.
+ * a compressed chunk is unpacked into a new chunk of its own for the reply.
+ */
+char*
+ringpin(Ring *r, vlong off, u32int *count, Chunk **cp)
+{
+	Chunk *c, *t;
+	long o;
+
+	c = r->chunks[(off / CHUNK) % r->nchunks];
+	o = off % CHUNK;
+	if(*count > CHUNK - o)
+		*count = CHUNK - o;
+	if(c->z != nil){
+		t = newchunk();
+		t->base = c->base;
+		memmove(t->data, zdata(r, c), CHUNK);
+		*cp = t;
+		return t->data + o;
+	}
+	incref(c);
+	*cp = c;
+	return c->data + o;
+}
+
+/* drop the data before stream offset off, giving the chunks back once the ring is empty */
+void
+ringtrunc(Ring *r, vlong off)
+{
+	int i;
+
+	if(off > r->woff)
+		off = r->woff;
+	if(off > r->tail)
+		r->tail = off;
+	if(r->tail < r->woff)
+		return;
+	for(i = 0; i < r->nchunks; i++)
+		if(r->chunks[i] != nil)
+			slotput(r, &r->chunks[i]);
+}
+
+void
+chunkput(Chunk *c)
+{
+	if(decref(c) == 0){
+		free(c->z);
+		free(c);
+	}
+}
@@ -0,0 +1,40 @@
+enum{
+	CHUNK = 16*1024,			/* Ring data is stored in chunks of this size */
+};
+
+typedef struct Chunk Chunk;		/* Piece of ring storage */
+typedef struct Ring Ring;		/* Byte stream keeping its newest size bytes */
+
+struct Chunk{
+	Ref;						/* the ring and replies still being sent hold refs */
+	vlong base;					/* stream offset of data[0], a multiple of CHUNK */
+	char *z;					/* compressed data, nil if data holds it */
+	long nz;
+	char data[CHUNK];			/* not allocated for a compressed chunk */
+};
+
+struct Ring{
+	Chunk **chunks;				/* allocated as data arrives */
+	int nchunks;				/* slots, enough to hold size bytes */
+	uvlong size;				/* bytes kept before the oldest are overwritten */
+	vlong woff;					/* stream offset of the next byte written */
+	vlong tail;					/* stream offset of the oldest byte still held */
+	int zhot;					/* newest chunks left uncompressed, 0 to compress none */
+	vlong zpend;				/* oldest cold chunk a reply kept from being compressed, -1 if none */
+	int zchunks;				/* chunks held compressed */
+	vlong zbytes;				/* their compressed size */
+	char *zbuf;					/* the compressed chunk last unpacked for copying */
+	vlong zbase;				/* its base, -1 if none */
+};
+
+void ringinit(Ring *r, uvlong size);
+void ringfree(Ring *r);
+void ringresize(Ring *r, uvlong size);
+void ringcompress(Ring *r, uvlong hot);
+char* ringspace(Ring *r, long *n);
+void ringcommit(Ring *r, long n);
+void ringappend(Ring *r, char *data, long n);
+void ringcopy(Ring *r, vlong off, char *buf, long n);
+char* ringpin(Ring *r, vlong off, u32int *count, Chunk **cp);
+void ringtrunc(Ring *r, vlong off);
+void chunkput(Chunk *c);